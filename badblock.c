@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "protocol.h"
+#include "engine.h"
+#include "xbox.h"
+#include "badblock.h"
+
+// 64MB small block and 512MB big block parts both have 4096 blocks
+#define MAX_BLOCKS 4096
+
+#define SCAN_PAGES 2
+
+// Not a BAD_BLOCK_* code, the page lies beyond the end of the part
+#define SCAN_PAST_END 0x80
+
+static uint8_t codes[MAX_BLOCKS];
+static uint8_t bitmap[MAX_BLOCKS / 8];
+
+static uint8_t scan_page(uint32_t lba, uint32_t marker)
+{
+	uint8_t spare[0x10] __attribute__((aligned(4)));
+
+	int ret = xbox_nand_read_spare(lba, spare);
+	uint16_t status = ret ? ret : xbox_nand_get_status();
+	if (status & SFCX_STATUS_ADDR_ER)
+		return SCAN_PAST_END;
+	if (ret)
+		return BAD_BLOCK_READ_FAILED;
+
+	uint8_t code = 0;
+	if (status & SFCX_STATUS_BB_ER)
+		code |= BAD_BLOCK_CONTROLLER;
+	if (status & SFCX_STATUS_RNP_ER)
+		code |= BAD_BLOCK_READ_FAILED;
+	if (status & SFCX_STATUS_ECC_ER)
+		code |= BAD_BLOCK_ECC;
+	if (spare[marker] != 0xFF)
+		code |= BAD_BLOCK_MARKER;
+	return code;
+}
+
+void bad_block_scan()
+{
+	struct bad_block_scan scan;
+	scan.pages_per_block = xbox_nand_pages_per_block();
+	scan.blocks = xbox_nand_pages() / scan.pages_per_block;
+	scan.bad = 0;
+
+	if (scan.blocks > MAX_BLOCKS)
+		scan.blocks = MAX_BLOCKS;
+
+	uint32_t marker = scan.pages_per_block > 0x4000 / 0x200 ? 0 : 5;
+
+	memset(bitmap, 0, sizeof(bitmap));
+	for (uint32_t block = 0; block < scan.blocks; ++block)
+	{
+		codes[block] = 0;
+		for (uint32_t page = 0; page < SCAN_PAGES; ++page)
+			codes[block] |= scan_page(block * scan.pages_per_block + page, marker);
+
+		if (codes[block] & SCAN_PAST_END)
+		{
+			scan.blocks = block;
+			break;
+		}
+
+		if (codes[block] & BAD_BLOCK_BAD)
+		{
+			bitmap[block / 8] |= 1 << (block % 8);
+			++scan.bad;
+		}
+	}
+
+	reply_write(&scan, sizeof(scan));
+	reply_write(bitmap, (scan.blocks + 7) / 8);
+	reply_write(codes, scan.blocks);
+}
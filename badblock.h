@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BADBLOCK_H__
+#define __BADBLOCK_H__
+
+// core1, replies with a struct bad_block_scan, the bitmap and block codes
+void bad_block_scan();
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "protocol.h"
+#include "engine.h"
+#include "spiex.h"
+#include "xbox.h"
+#include "calibrate.h"
+
+// Dividers in half steps, 44MHz down to 8.3MHz at 266MHz
+#define CLKDIV_FASTEST 3
+#define CLKDIV_SLOWEST 16
+#define CLKDIV_COUNT (CLKDIV_SLOWEST - CLKDIV_FASTEST + 1)
+
+#define REGISTER_PASSES 64
+#define PAGE_PASSES 4
+
+// Sample points tried first when a divider has more than one clean one
+static const uint8_t sample_preference[SMC_SAMPLE_COUNT] = {SMC_SAMPLE_EDGE, SMC_SAMPLE_LATE, SMC_SAMPLE_EARLY};
+
+static struct smc_calibration_point points[CLKDIV_COUNT][SMC_SAMPLE_COUNT];
+
+static uint32_t reference_config;
+static uint8_t reference[0x210] __attribute__((aligned(4)));
+
+static uint32_t bit_errors(const uint8_t *page)
+{
+	const uint32_t *a = (const uint32_t *)page;
+	const uint32_t *b = (const uint32_t *)reference;
+	uint32_t errors = 0;
+
+	for (uint32_t i = 0; i < sizeof(reference) / 4; ++i)
+		errors += __builtin_popcount(a[i] ^ b[i]);
+	return errors;
+}
+
+static void measure(struct smc_calibration_point *point, uint32_t lba)
+{
+	static uint8_t page[0x210] __attribute__((aligned(4)));
+
+	spiex_set_timing(point->clkdiv, point->sample);
+
+	for (uint32_t i = 0; i < REGISTER_PASSES; ++i)
+	{
+		point->errors += __builtin_popcount(spiex_read_reg(0x00) ^ reference_config);
+		point->bits += 32;
+	}
+
+	for (uint32_t i = 0; i < PAGE_PASSES; ++i)
+	{
+		// A read that failed outright counts as every bit wrong
+		if (xbox_nand_read_block(lba, page, &page[0x200]))
+			point->errors += sizeof(page) * 8;
+		else
+			point->errors += bit_errors(page);
+		point->bits += sizeof(page) * 8;
+	}
+}
+
+static bool clean(uint32_t div, uint32_t sample)
+{
+	return !points[div][sample].errors;
+}
+
+// Fastest clean point that still has a clean faster divider at the same
+// sample point, else the slowest clean one
+static struct smc_calibration_point *select_point(uint32_t *status)
+{
+	for (uint32_t div = 1; div < CLKDIV_COUNT; ++div)
+		for (uint32_t i = 0; i < SMC_SAMPLE_COUNT; ++i)
+		{
+			uint32_t sample = sample_preference[i];
+			if (clean(div, sample) && clean(div - 1, sample))
+				return &points[div][sample];
+		}
+
+	*status = SMC_CALIBRATE_NO_MARGIN;
+	for (int div = CLKDIV_COUNT - 1; div >= 0; --div)
+		for (uint32_t i = 0; i < SMC_SAMPLE_COUNT; ++i)
+			if (clean(div, sample_preference[i]))
+				return &points[div][sample_preference[i]];
+
+	*status = SMC_CALIBRATE_FAILED;
+	return NULL;
+}
+
+void smc_calibrate(uint32_t lba)
+{
+	struct smc_calibration result;
+	memset(&result, 0, sizeof(result));
+
+	uint32_t clkdiv, sample;
+	spiex_get_timing(&clkdiv, &sample);
+
+	if (!spiex_running())
+	{
+		result.status = SMC_CALIBRATE_NOT_RUNNING;
+		reply_write(&result, sizeof(result));
+		return;
+	}
+
+	spiex_set_timing(CLKDIV_SLOWEST, SMC_SAMPLE_EDGE);
+	reference_config = spiex_read_reg(0x00);
+	result.status = xbox_nand_read_block(lba, reference, &reference[0x200]);
+
+	if (!result.status)
+	{
+		memset(points, 0, sizeof(points));
+		for (uint32_t div = 0; div < CLKDIV_COUNT; ++div)
+			for (uint32_t i = 0; i < SMC_SAMPLE_COUNT; ++i)
+			{
+				struct smc_calibration_point *point = &points[div][i];
+				point->clkdiv = CLKDIV_FASTEST + div;
+				point->sample = i;
+				point->baudrate = spiex_baudrate(point->clkdiv);
+				measure(point, lba);
+			}
+
+		result.count = CLKDIV_COUNT * SMC_SAMPLE_COUNT;
+
+		struct smc_calibration_point *selected = select_point(&result.status);
+		if (selected)
+		{
+			result.selected = *selected;
+			clkdiv = selected->clkdiv;
+			sample = selected->sample;
+		}
+	}
+
+	spiex_set_timing(clkdiv, sample);
+
+	// A write garbled at a too fast setting may have hit the config register
+	if (spiex_read_reg(0x00) != reference_config)
+		spiex_write_reg(0x00, reference_config);
+	xbox_nand_clear_status();
+
+	if (result.status == SMC_CALIBRATE_FAILED || !result.count)
+	{
+		result.selected.clkdiv = clkdiv;
+		result.selected.sample = sample;
+		result.selected.baudrate = spiex_baudrate(clkdiv);
+	}
+
+	reply_write(&result, sizeof(result));
+	reply_write(points, result.count * sizeof(struct smc_calibration_point));
+}
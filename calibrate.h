@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CALIBRATE_H__
+#define __CALIBRATE_H__
+
+#include <stdint.h>
+
+// core1, replies with a struct smc_calibration and the measured points
+void smc_calibrate(uint32_t lba);
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pico/stdlib.h"
+#include "protocol.h"
+#include "engine.h"
+#include "checksum.h"
+#include "xbox.h"
+#include "sdio.h"
+#include "crc32.h"
+
+// Standard CRC-32 (zlib), so the host can compare against crc32() of the
+// same bytes of its image.
+uint32_t crc32_update(uint32_t crc, const void *data, uint32_t length)
+{
+	const uint8_t *p = data;
+
+	crc = ~crc;
+	while (length--)
+		crc = crc32_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static struct checksum_digest digest;
+static uint32_t digest_pages;
+
+static void digest_page(uint32_t chunk, const void *page, uint32_t size)
+{
+	digest.crc = crc32_update(digest.crc, page, size);
+
+	if (++digest_pages == chunk)
+	{
+		reply_write(&digest, sizeof(digest));
+		digest.crc = 0;
+		digest_pages = 0;
+	}
+}
+
+static void digest_start(uint32_t *count, uint32_t *chunk)
+{
+	if (!*chunk || *chunk > *count)
+		*chunk = *count;
+
+	digest.status = 0;
+	digest.crc = 0;
+	digest_pages = 0;
+}
+
+// Sends the short last chunk, or the failing one
+static void digest_finish(uint32_t status)
+{
+	digest.status = status;
+	if (digest_pages || status)
+		reply_write(&digest, sizeof(digest));
+}
+
+void checksum_nand(uint32_t lba, uint32_t count, uint32_t chunk)
+{
+	static uint8_t page[0x210] __attribute__((aligned(4)));
+
+	digest_start(&count, &chunk);
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t ret = xbox_nand_read_block(lba + i, page, &page[0x200]);
+		if (ret)
+		{
+			digest_finish(ret);
+			return;
+		}
+
+		digest_page(chunk, page, sizeof(page));
+	}
+
+	digest_finish(0);
+}
+
+static uint32_t nand_crc(uint32_t lba, uint32_t count, uint32_t *crc)
+{
+	static uint8_t page[0x210] __attribute__((aligned(4)));
+
+	*crc = 0;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t ret = xbox_nand_read_block(lba + i, page, &page[0x200]);
+		if (ret)
+			return ret;
+
+		*crc = crc32_update(*crc, page, sizeof(page));
+	}
+
+	return 0;
+}
+
+// Blocks that fail to read are reported as changed, the first error is
+// passed back in the status.
+void flash_diff(uint32_t lba, const struct flash_diff_args *args)
+{
+	uint32_t pages = xbox_nand_pages_per_block();
+	uint32_t count = args->count;
+	uint32_t status = 0;
+	uint8_t changed[FLASH_DIFF_MAX_BLOCKS / 8] = {0};
+
+	if (count > FLASH_DIFF_MAX_BLOCKS || lba % pages)
+	{
+		status = FLASH_DIFF_BAD_ARGS;
+		count = 0;
+	}
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t crc;
+		uint32_t ret = nand_crc(lba + i * pages, pages, &crc);
+		if (ret && !status)
+			status = ret;
+
+		if (ret || crc != args->crc[i])
+			changed[i / 8] |= 1 << (i % 8);
+	}
+
+	reply_write(&status, 4);
+	reply_write(changed, (count + 7) / 8);
+}
+
+// Reads the next batch while the previous one is hashed
+void checksum_emmc(uint32_t lba, uint32_t count, uint32_t chunk)
+{
+	static uint8_t buffers[2][SDIO_MAX_BLOCK_COUNT * SD_SECTOR_SIZE] __attribute__((aligned(4)));
+
+	digest_start(&count, &chunk);
+
+	uint32_t done = 0;
+	uint32_t batch = 0;
+	uint32_t reading = 0;
+	while (done < count)
+	{
+		uint32_t next = done + batch;
+		uint32_t ahead = count - next;
+		if (ahead > SDIO_MAX_BLOCK_COUNT)
+			ahead = SDIO_MAX_BLOCK_COUNT;
+
+		int ret = 0;
+		if (ahead)
+			ret = sd_readblocks_async(buffers[reading], lba + next, ahead);
+
+		uint8_t *sectors = buffers[reading ^ 1];
+		for (uint32_t i = 0; i < batch; ++i)
+			digest_page(chunk, &sectors[i * SD_SECTOR_SIZE], SD_SECTOR_SIZE);
+		done += batch;
+
+		if (ahead)
+		{
+			if (!ret)
+				while (!sd_scatter_read_complete(&ret))
+					tight_loop_contents();
+
+			if (ret)
+			{
+				digest_finish(ret);
+				return;
+			}
+		}
+
+		batch = ahead;
+		reading ^= 1;
+	}
+
+	digest_finish(0);
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+#include <stdint.h>
+#include "protocol.h"
+
+uint32_t crc32_update(uint32_t crc, const void *data, uint32_t length);
+
+// core1, replies with one struct checksum_digest per chunk of pages
+void checksum_nand(uint32_t lba, uint32_t count, uint32_t chunk);
+void checksum_emmc(uint32_t lba, uint32_t count, uint32_t chunk);
+void flash_diff(uint32_t lba, const struct flash_diff_args *args);
+
+#endif
@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+
+#include "picoflasher.h"
+
+// Measures per-command latency and MB/s of the read, checksum and write paths
+// against a device or the simulator, for comparing firmware versions.
+//
+//   picoflasher-bench [--pages N] [--start LBA] [--iterations N] [--emmc]
+//                     [--write] [--calibrate] [--json] <port>
+//
+// --write rewrites the benchmarked range with the data read from it first,
+// whole erase blocks only. --calibrate runs SMC_CALIBRATE on the start page
+// first and prints the sweep to stderr, the benchmarks then run at the
+// selected SPI timing. <port> is the CDC tty, or on Linux the usbfs node of
+// the device, e.g. /dev/bus/usb/001/005, to go through the vendor bulk
+// interface instead.
+
+using namespace picoflasher;
+typedef std::chrono::steady_clock bench_clock;
+
+struct result
+{
+	std::string name;
+	uint8_t opcode;
+
+	// latency
+	std::vector<double> latency_us;
+
+	// throughput
+	uint32_t pages = 0;
+	uint64_t bytes = 0;	 // page data moved
+	uint64_t wire = 0;	 // bytes that crossed USB, if known
+	double seconds = 0;
+};
+
+static std::vector<result> results;
+
+static double elapsed(bench_clock::time_point start)
+{
+	return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// As xbox_nand_pages_per_block()
+static uint32_t pages_per_block(uint32_t flash_config)
+{
+	int major = (flash_config >> 17) & 3;
+	int minor = (flash_config >> 4) & 3;
+
+	uint32_t blocksize = 0x4000;
+	if (major >= 1 && minor == 2)
+		blocksize = 0x20000;
+	else if (major >= 1 && minor == 3)
+		blocksize = 0x40000;
+
+	return blocksize / 0x200;
+}
+
+static bool supported(const struct caps &caps, uint8_t cmd)
+{
+	return caps.commands[cmd / 8] & (1 << (cmd % 8));
+}
+
+static void latency(device &dev, const char *name, uint8_t cmd, uint32_t lba, uint32_t iterations)
+{
+	result r;
+	r.name = std::string("latency.") + name;
+	r.opcode = cmd;
+
+	for (uint32_t i = 0; i < iterations; ++i)
+	{
+		auto start = bench_clock::now();
+		std::future<reply> future = dev.submit(cmd, lba);
+		dev.wait(future);
+		r.latency_us.push_back(elapsed(start) * 1e6);
+	}
+
+	results.push_back(r);
+}
+
+static void throughput(const char *name, uint8_t cmd, uint32_t pages, uint64_t bytes, uint64_t wire, double seconds)
+{
+	result r;
+	r.name = std::string("throughput.") + name;
+	r.opcode = cmd;
+	r.pages = pages;
+	r.bytes = bytes;
+	r.wire = wire;
+	r.seconds = seconds;
+	results.push_back(r);
+}
+
+// READ_FLASH with up to depth commands in flight
+static void read_pipelined(device &dev, uint32_t start, uint32_t count, uint32_t depth)
+{
+	std::deque<std::future<reply>> in_flight;
+	uint64_t wire = 0;
+
+	auto began = bench_clock::now();
+	for (uint32_t i = 0; i < count || !in_flight.empty();)
+	{
+		if (i < count && in_flight.size() < depth)
+		{
+			in_flight.push_back(dev.submit(READ_FLASH, start + i++));
+			continue;
+		}
+
+		reply r = dev.wait(in_flight.front());
+		in_flight.pop_front();
+		wire += sizeof(frame_reply) + r.data.size();
+	}
+
+	throughput("READ_FLASH", READ_FLASH, count, (uint64_t)count * 0x210, wire, elapsed(began));
+}
+
+static void read_stream(device &dev, bool emmc, uint32_t flags, uint32_t start, uint32_t count, std::vector<uint8_t> *image)
+{
+	uint32_t size = emmc ? 0x200 : 0x210;
+	if (dev.set_stream_flags(flags) != flags)
+		return;
+
+	if (image)
+		image->resize((uint64_t)count * size);
+
+	std::vector<uint32_t> edc_mismatch;
+	auto began = bench_clock::now();
+	uint64_t wire = dev.read_stream(emmc, start, count, [&](uint32_t lba, const uint8_t *page, uint32_t length)
+	{
+		if (image)
+			memcpy(&(*image)[(uint64_t)(lba - start) * size], page, length);
+	}, &edc_mismatch);
+	double seconds = elapsed(began);
+
+	std::string name = emmc ? "EMMC_READ_STREAM_RANGE" : "READ_FLASH_STREAM_RANGE";
+	if (flags & STREAM_FLAG_COMPRESS)
+		name += ".compressed";
+	if (flags & STREAM_FLAG_EDC)
+	{
+		name += ".edc";
+		fprintf(stderr, "%s: %zu pages with a bad EDC\n", name.c_str(), edc_mismatch.size());
+	}
+	throughput(name.c_str(), emmc ? EMMC_READ_STREAM_RANGE : READ_FLASH_STREAM_RANGE, count, (uint64_t)count * size, wire, seconds);
+
+	dev.set_stream_flags(0);
+}
+
+static void spare_map(device &dev, uint32_t start, uint32_t count)
+{
+	auto began = bench_clock::now();
+	uint64_t wire = dev.read_spare_map(start, count, [](uint32_t lba, const uint8_t *spare, uint32_t length) {});
+	double seconds = elapsed(began);
+
+	throughput("READ_FLASH_SPARE_STREAM", READ_FLASH_SPARE_STREAM, count, (uint64_t)count * 0x10, wire, seconds);
+}
+
+static void checksum(device &dev, bool emmc, uint32_t start, uint32_t count)
+{
+	struct checksum_args args = {count, 0};
+	uint8_t cmd = emmc ? EMMC_CHECKSUM : FLASH_CHECKSUM;
+
+	auto began = bench_clock::now();
+	std::future<reply> future = dev.submit(cmd, start, &args, sizeof(args));
+	reply r = dev.wait(future);
+	double seconds = elapsed(began);
+
+	struct checksum_digest digest = {};
+	memcpy(&digest, r.data.data(), std::min(r.data.size(), sizeof(digest)));
+	if (digest.status)
+		throw error(emmc ? "EMMC_CHECKSUM" : "FLASH_CHECKSUM", digest.status);
+
+	throughput(emmc ? "EMMC_CHECKSUM" : "FLASH_CHECKSUM", cmd, count, (uint64_t)count * (emmc ? 0x200 : 0x210), sizeof(frame_reply) + r.data.size(), seconds);
+}
+
+static void write_stream(device &dev, bool emmc, uint32_t start, uint32_t count, const std::vector<uint8_t> &image)
+{
+	uint32_t size = emmc ? 0x200 : 0x210;
+
+	auto began = bench_clock::now();
+	std::vector<write_ack> failed = dev.write_stream(emmc, start, count, [&](uint32_t i) { return &image[(uint64_t)i * size]; });
+	double seconds = elapsed(began);
+
+	if (!failed.empty())
+		throw error(emmc ? "EMMC_WRITE_STREAM" : "WRITE_FLASH_STREAM", failed[0].status);
+
+	uint64_t wire = (uint64_t)count * size + sizeof(frame) + 4;
+	throughput(emmc ? "EMMC_WRITE_STREAM" : "WRITE_FLASH_STREAM", emmc ? EMMC_WRITE_STREAM : WRITE_FLASH_STREAM, count, (uint64_t)count * size, wire, seconds);
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+	std::sort(values.begin(), values.end());
+	return values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+}
+
+static void print_text()
+{
+	for (const result &r : results)
+	{
+		if (!r.latency_us.empty())
+		{
+			double total = 0;
+			for (double us : r.latency_us)
+				total += us;
+			printf("%-40s %8.1f us mean %8.1f p50 %8.1f p99 %8.1f max\n", r.name.c_str(), total / r.latency_us.size(),
+				   percentile(r.latency_us, 0.5), percentile(r.latency_us, 0.99), percentile(r.latency_us, 1));
+		}
+		else
+		{
+			printf("%-40s %8.3f MB/s %8u pages %8.3f s %10llu wire bytes\n", r.name.c_str(), r.bytes / r.seconds / 1e6, r.pages,
+				   r.seconds, (unsigned long long)r.wire);
+		}
+	}
+}
+
+static void print_json(const char *port, uint32_t version, uint32_t flash_config)
+{
+	printf("{\"tool\":\"picoflasher-bench\",\"port\":\"%s\",\"firmware_version\":%u,\"flash_config\":%u,\"results\":[", port, version, flash_config);
+
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const result &r = results[i];
+		printf("%s{\"name\":\"%s\",\"opcode\":%u", i ? "," : "", r.name.c_str(), r.opcode);
+
+		if (!r.latency_us.empty())
+		{
+			double total = 0;
+			for (double us : r.latency_us)
+				total += us;
+			printf(",\"iterations\":%zu,\"latency_us\":{\"min\":%.1f,\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f}}",
+				   r.latency_us.size(), percentile(r.latency_us, 0), total / r.latency_us.size(), percentile(r.latency_us, 0.5),
+				   percentile(r.latency_us, 0.99), percentile(r.latency_us, 1));
+		}
+		else
+		{
+			printf(",\"pages\":%u,\"bytes\":%llu,\"wire_bytes\":%llu,\"seconds\":%.6f,\"mb_per_s\":%.3f}", r.pages,
+				   (unsigned long long)r.bytes, (unsigned long long)r.wire, r.seconds, r.bytes / r.seconds / 1e6);
+		}
+	}
+
+	printf("]}\n");
+}
+
+static void calibrate(device &dev, uint32_t lba)
+{
+	static const char *samples[SMC_SAMPLE_COUNT] = {"early", "edge", "late"};
+
+	calibration c = dev.calibrate(lba);
+	for (const smc_calibration_point &p : c.points)
+		fprintf(stderr, "calibration %5.1f MHz %-5s %10u bits %10u errors\n", p.baudrate / 1e6,
+				samples[p.sample % SMC_SAMPLE_COUNT], p.bits, p.errors);
+
+	fprintf(stderr, "calibration selected %.1f MHz %s, status 0x%x\n", c.result.selected.baudrate / 1e6,
+			samples[c.result.selected.sample % SMC_SAMPLE_COUNT], c.result.status);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [--pages N] [--start LBA] [--iterations N] [--emmc] [--write] [--calibrate] [--json] <port>\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t pages = 1024;
+	uint32_t start = 0;
+	uint32_t iterations = 100;
+	bool emmc = false;
+	bool write = false;
+	bool calibrate_first = false;
+	bool json = false;
+	const char *port = NULL;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--pages") && i + 1 < argc)
+			pages = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--start") && i + 1 < argc)
+			start = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+			iterations = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--emmc"))
+			emmc = true;
+		else if (!strcmp(argv[i], "--write"))
+			write = true;
+		else if (!strcmp(argv[i], "--calibrate"))
+			calibrate_first = true;
+		else if (!strcmp(argv[i], "--json"))
+			json = true;
+		else if (argv[i][0] != '-' && !port)
+			port = argv[i];
+		else
+			usage(argv[0]);
+	}
+	if (!port || !pages || !iterations)
+		usage(argv[0]);
+
+	try
+	{
+		device dev(port);
+
+		uint32_t version = dev.version();
+		struct caps caps = dev.caps();
+		uint32_t flash_config = dev.flash_config();
+
+		if (calibrate_first)
+		{
+			if (!supported(caps, SMC_CALIBRATE))
+				throw error("SMC_CALIBRATE not supported", 0);
+			calibrate(dev, start);
+		}
+
+		latency(dev, "GET_VERSION", GET_VERSION, 0, iterations);
+		latency(dev, "GET_FLASH_CONFIG", GET_FLASH_CONFIG, 0, iterations);
+		latency(dev, "GET_CAPS", GET_CAPS, 0, iterations);
+		if (supported(caps, GET_STATS))
+			latency(dev, "GET_STATS", GET_STATS, 0, iterations);
+		latency(dev, "READ_FLASH", READ_FLASH, start, iterations);
+
+		read_pipelined(dev, start, pages, std::max<uint32_t>(caps.jobs_in_flight, 1));
+
+		std::vector<uint8_t> image;
+		read_stream(dev, false, 0, start, pages, &image);
+		if (caps.stream_flags & STREAM_FLAG_COMPRESS)
+			read_stream(dev, false, STREAM_FLAG_COMPRESS, start, pages, NULL);
+		if (caps.stream_flags & STREAM_FLAG_EDC)
+			read_stream(dev, false, STREAM_FLAG_EDC, start, pages, NULL);
+		if (supported(caps, READ_FLASH_SPARE_STREAM))
+			spare_map(dev, start, pages);
+		if (supported(caps, FLASH_CHECKSUM))
+			checksum(dev, false, start, pages);
+
+		if (write)
+		{
+			uint32_t block = pages_per_block(flash_config);
+			if (start % block || pages % block)
+				throw error("--write needs whole erase blocks", block);
+			write_stream(dev, false, start, pages, image);
+		}
+
+		if (emmc)
+		{
+			std::future<reply> init = dev.submit(EMMC_INIT, 0);
+			reply r = dev.wait(init);
+			if (r.data.size() < 4 || r.data[0] || r.data[1] || r.data[2] || r.data[3])
+				throw error("EMMC_INIT", r.data.empty() ? 0 : r.data[0]);
+
+			latency(dev, "EMMC_READ", EMMC_READ, start, iterations);
+
+			read_stream(dev, true, 0, start, pages, &image);
+			if (caps.stream_flags & STREAM_FLAG_COMPRESS)
+				read_stream(dev, true, STREAM_FLAG_COMPRESS, start, pages, NULL);
+			if (supported(caps, EMMC_CHECKSUM))
+				checksum(dev, true, start, pages);
+			if (write)
+				write_stream(dev, true, start, pages, image);
+		}
+
+		if (json)
+			print_json(port, version, flash_config);
+		else
+			print_text();
+	}
+	catch (const std::exception &e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
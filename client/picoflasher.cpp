@@ -0,0 +1,592 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <system_error>
+
+#include "picoflasher.h"
+
+extern "C"
+{
+#include "lz.h"
+}
+
+namespace picoflasher
+{
+
+static int64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t reply_u32(const reply &result, size_t offset = 0)
+{
+	if (result.data.size() < offset + 4)
+		throw error("short reply", result.data.size());
+
+	uint32_t value;
+	memcpy(&value, &result.data[offset], 4);
+	return value;
+}
+
+// The vendor bulk interface, see usb_descriptors.c
+static const unsigned int USB_VENDOR_INTERFACE = 2;
+static const unsigned char USB_VENDOR_OUT = 0x03;
+static const unsigned char USB_VENDOR_IN = 0x83;
+static const unsigned int USB_BULK_SIZE = 0x4000;
+
+device::device(const std::string &path)
+{
+	usbfs = !path.compare(0, 13, "/dev/bus/usb/");
+
+	fd = open(path.c_str(), usbfs ? O_RDWR : O_RDWR | O_NOCTTY);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), path);
+
+	if (usbfs)
+	{
+		unsigned int interface = USB_VENDOR_INTERFACE;
+		if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &interface) < 0)
+		{
+			int claim_errno = errno;
+			close(fd);
+			throw std::system_error(claim_errno, std::generic_category(), "claim vendor interface");
+		}
+
+		last_rx = now_ns();
+		reader = std::thread(&device::reader_main, this);
+		return;
+	}
+
+	struct termios tio;
+	if (tcgetattr(fd, &tio) == 0)
+	{
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+	tcflush(fd, TCIOFLUSH);
+
+	last_rx = now_ns();
+	reader = std::thread(&device::reader_main, this);
+}
+
+device::~device()
+{
+	stopping = true;
+	reader.join();
+	if (usbfs)
+	{
+		unsigned int interface = USB_VENDOR_INTERFACE;
+		ioctl(fd, USBDEVFS_RELEASEINTERFACE, &interface);
+	}
+	close(fd);
+}
+
+ssize_t device::read_some(void *data, size_t length)
+{
+	if (!usbfs)
+	{
+		struct pollfd pfd = {fd, POLLIN, 0};
+		if (poll(&pfd, 1, 100) <= 0)
+			return 0;
+		return read(fd, data, length);
+	}
+
+	// Whole packets only, a short one ends the transfer
+	struct usbdevfs_bulktransfer bulk = {};
+	bulk.ep = USB_VENDOR_IN;
+	bulk.len = std::min<size_t>(length, USB_BULK_SIZE) & ~0x3Fu;
+	bulk.timeout = 100;
+	bulk.data = data;
+	return ioctl(fd, USBDEVFS_BULK, &bulk);
+}
+
+ssize_t device::write_some(const void *data, size_t length)
+{
+	if (!usbfs)
+		return write(fd, data, length);
+
+	struct usbdevfs_bulktransfer bulk = {};
+	bulk.ep = USB_VENDOR_OUT;
+	bulk.len = std::min<size_t>(length, USB_BULK_SIZE);
+	bulk.timeout = timeout.count();
+	bulk.data = const_cast<void *>(data);
+	return ioctl(fd, USBDEVFS_BULK, &bulk);
+}
+
+void device::write_all(const void *data, size_t length)
+{
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+
+	while (length)
+	{
+		ssize_t written = write_some(bytes, length);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::system_error(errno, std::generic_category(), "write");
+		}
+
+		bytes += written;
+		length -= written;
+	}
+}
+
+std::future<reply> device::submit(uint8_t cmd, uint32_t lba, const void *payload, uint32_t length, frame_handler handler)
+{
+	std::lock_guard<std::mutex> writing(write_lock);
+
+	struct frame header = {};
+	header.magic = FRAME_MAGIC;
+	header.version = FRAME_VERSION;
+	header.cmd = cmd;
+	header.lba = lba;
+	header.length = length;
+
+	std::future<reply> future;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		// A stream replaced by a newer one never gets its end frame
+		if (cmd_starts_stream(cmd))
+		{
+			for (auto it = requests.begin(); it != requests.end();)
+			{
+				if (!it->second.stream)
+				{
+					++it;
+					continue;
+				}
+
+				it->second.promise.set_exception(std::make_exception_ptr(error("stream replaced", 0)));
+				it = requests.erase(it);
+			}
+		}
+
+		header.seq = next_seq++;
+		pending &request = requests[header.seq];
+		request.handler = std::move(handler);
+		request.stream = cmd_starts_stream(cmd);
+		future = request.promise.get_future();
+	}
+
+	std::vector<uint8_t> buffer(sizeof(header) + length);
+	memcpy(buffer.data(), &header, sizeof(header));
+	if (length)
+		memcpy(&buffer[sizeof(header)], payload, length);
+	write_all(buffer.data(), buffer.size());
+
+	return future;
+}
+
+void device::send(const void *data, size_t length)
+{
+	std::lock_guard<std::mutex> writing(write_lock);
+	write_all(data, length);
+}
+
+void device::dispatch(const frame_reply &header, const uint8_t *data)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	auto it = requests.find(header.seq);
+	if (it == requests.end())
+		return;
+
+	pending &request = it->second;
+	if (header.status != FRAME_OK)
+		request.result.status = header.status;
+
+	try
+	{
+		if (request.handler)
+			request.handler(data, header.length);
+		else
+			request.result.data.insert(request.result.data.end(), data, data + header.length);
+	}
+	catch (...)
+	{
+		request.promise.set_exception(std::current_exception());
+		requests.erase(it);
+		return;
+	}
+
+	if (header.flags & FRAME_END)
+	{
+		request.promise.set_value(std::move(request.result));
+		requests.erase(it);
+	}
+}
+
+void device::reader_main()
+{
+	std::vector<uint8_t> buffer;
+	size_t used = 0;
+
+	while (!stopping)
+	{
+		buffer.resize(used + 0x10000);
+		ssize_t length = read_some(&buffer[used], 0x10000);
+		if (length <= 0)
+			continue;
+		used += length;
+		last_rx = now_ns();
+
+		size_t offset = 0;
+		while (used - offset >= sizeof(frame_reply))
+		{
+			// Anything but a reply frame is skipped until the next magic
+			if (buffer[offset] != FRAME_REPLY_MAGIC)
+			{
+				++offset;
+				continue;
+			}
+
+			frame_reply header;
+			memcpy(&header, &buffer[offset], sizeof(header));
+			if (used - offset < sizeof(header) + header.length)
+				break;
+
+			dispatch(header, &buffer[offset + sizeof(header)]);
+			offset += sizeof(header) + header.length;
+		}
+
+		memmove(buffer.data(), &buffer[offset], used - offset);
+		used -= offset;
+	}
+}
+
+reply device::wait(std::future<reply> &future)
+{
+	int64_t start = now_ns();
+
+	while (future.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready)
+	{
+		int64_t idle = now_ns() - std::max<int64_t>(start, last_rx);
+		if (idle > std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count())
+			throw error("timeout", 0);
+	}
+
+	reply result = future.get();
+	if (result.status != FRAME_OK)
+		throw error("frame status", result.status);
+	return result;
+}
+
+reply device::call(uint8_t cmd, uint32_t lba, const void *payload, uint32_t length)
+{
+	std::future<reply> future = submit(cmd, lba, payload, length);
+	return wait(future);
+}
+
+uint32_t device::version()
+{
+	return reply_u32(call(GET_VERSION));
+}
+
+uint32_t device::flash_config()
+{
+	return reply_u32(call(GET_FLASH_CONFIG));
+}
+
+struct caps device::caps()
+{
+	reply result = call(GET_CAPS);
+
+	struct caps value = {};
+	memcpy(&value, result.data.data(), std::min(result.data.size(), sizeof(value)));
+	return value;
+}
+
+uint32_t device::set_stream_flags(uint32_t flags)
+{
+	stream_flags = reply_u32(call(SET_STREAM_FLAGS, flags));
+	return stream_flags;
+}
+
+std::vector<uint8_t> device::read_page(uint32_t lba)
+{
+	reply result = call(READ_FLASH, lba);
+	uint32_t status = reply_u32(result);
+	if (status)
+		throw error("READ_FLASH", status);
+
+	return std::vector<uint8_t>(result.data.begin() + 4, result.data.end());
+}
+
+void device::write_page(uint32_t lba, const uint8_t *page)
+{
+	uint32_t status = reply_u32(call(WRITE_FLASH, lba, page, 0x210));
+	if (status)
+		throw error("WRITE_FLASH", status);
+}
+
+std::vector<uint8_t> device::emmc_read(uint32_t lba)
+{
+	reply result = call(EMMC_READ, lba);
+	uint32_t status = reply_u32(result);
+	if (status)
+		throw error("EMMC_READ", status);
+
+	return std::vector<uint8_t>(result.data.begin() + 4, result.data.end());
+}
+
+calibration device::calibrate(uint32_t lba)
+{
+	reply result = call(SMC_CALIBRATE, lba);
+	if (result.data.size() < sizeof(smc_calibration))
+		throw error("SMC_CALIBRATE", 0);
+
+	calibration value;
+	memcpy(&value.result, result.data.data(), sizeof(value.result));
+
+	size_t count = std::min<size_t>(value.result.count, (result.data.size() - sizeof(smc_calibration)) / sizeof(smc_calibration_point));
+	value.points.resize(count);
+	memcpy(value.points.data(), result.data.data() + sizeof(smc_calibration), count * sizeof(smc_calibration_point));
+	return value;
+}
+
+bad_block_map device::bad_block_scan()
+{
+	reply result = call(NAND_BAD_BLOCK_SCAN, 0);
+	if (result.data.size() < sizeof(struct bad_block_scan))
+		throw error("NAND_BAD_BLOCK_SCAN", 0);
+
+	bad_block_map value;
+	memcpy(&value.result, result.data.data(), sizeof(value.result));
+
+	size_t bitmap = (value.result.blocks + 7) / 8;
+	if (result.data.size() < sizeof(struct bad_block_scan) + bitmap + value.result.blocks)
+		throw error("NAND_BAD_BLOCK_SCAN", 0);
+
+	auto data = result.data.begin() + sizeof(struct bad_block_scan);
+	value.bitmap.assign(data, data + bitmap);
+	value.codes.assign(data + bitmap, data + bitmap + value.result.blocks);
+	return value;
+}
+
+uint64_t device::read_stream(bool emmc, uint32_t start, uint32_t count, page_handler handler, std::vector<uint32_t> *edc_mismatch,
+							 std::vector<uint32_t> *failed)
+{
+	uint32_t size = emmc ? 0x200 : 0x210;
+	bool compressed = stream_flags & STREAM_FLAG_COMPRESS;
+	bool skip = stream_flags & STREAM_FLAG_CONTINUE;
+
+	uint64_t bytes = 0;
+	uint32_t next = start;
+	uint32_t status = 0;
+	std::vector<uint8_t> page(size);
+
+	auto frame = [&](const uint8_t *data, size_t length)
+	{
+		bytes += sizeof(frame_reply) + length;
+
+		if (!compressed)
+		{
+			if (length < 4)
+				return;
+			memcpy(&status, data, 4);
+			if (status == STREAM_EDC_MISMATCH)
+			{
+				if (edc_mismatch)
+					edc_mismatch->push_back(next);
+				status = 0;
+			}
+			if (status && skip)
+			{
+				if (failed)
+					failed->push_back(next);
+				++next;
+				status = 0;
+			}
+			else if (!status && length >= 4 + size)
+				handler(next++, data + 4, size);
+			return;
+		}
+
+		size_t offset = 0;
+		while (length - offset >= sizeof(stream_record))
+		{
+			stream_record record;
+			memcpy(&record, data + offset, sizeof(record));
+			const uint8_t *payload = data + offset + sizeof(record);
+			offset += sizeof(record) + record.length;
+			if (offset > length)
+				throw error("truncated stream record", record.lba);
+
+			if (record.type == STREAM_RECORD_RAW)
+			{
+				handler(record.lba, payload, size);
+			}
+			else if (record.type == STREAM_RECORD_EDC)
+			{
+				if (edc_mismatch)
+					edc_mismatch->push_back(record.lba);
+				handler(record.lba, payload, size);
+			}
+			else if (record.type == STREAM_RECORD_FILL)
+			{
+				memset(page.data(), record.value, size);
+				for (uint32_t i = 0; i < record.count; ++i)
+					handler(record.lba + i, page.data(), size);
+			}
+			else if (record.type == STREAM_RECORD_LZ)
+			{
+				if (lz_decompress(payload, record.length, page.data(), size) != (int)size)
+					throw error("bad LZ record", record.lba);
+				handler(record.lba, page.data(), size);
+			}
+			else if (record.type == STREAM_RECORD_ERROR && skip)
+			{
+				if (failed)
+					failed->push_back(record.lba);
+			}
+			else if (record.type == STREAM_RECORD_ERROR)
+			{
+				memcpy(&status, payload, 4);
+			}
+		}
+	};
+
+	uint32_t range = count;
+	std::future<reply> future = submit(emmc ? EMMC_READ_STREAM_RANGE : READ_FLASH_STREAM_RANGE, start, &range, 4, frame);
+	wait(future);
+
+	if (status)
+		throw error("read stream", status);
+	return bytes;
+}
+
+uint64_t device::read_spare_map(uint32_t start, uint32_t count, page_handler handler)
+{
+	uint64_t bytes = 0;
+	uint32_t next = start;
+	uint32_t status = 0;
+
+	auto frame = [&](const uint8_t *data, size_t length)
+	{
+		bytes += sizeof(frame_reply) + length;
+		if (length < 4)
+			return;
+
+		memcpy(&status, data, 4);
+		for (size_t offset = 4; offset + 0x10 <= length; offset += 0x10)
+			handler(next++, data + offset, 0x10);
+	};
+
+	uint32_t range = count;
+	std::future<reply> future = submit(READ_FLASH_SPARE_STREAM, start, &range, 4, frame);
+	wait(future);
+
+	if (status)
+		throw error("spare stream", status);
+	return bytes;
+}
+
+std::vector<write_ack> device::write_stream(bool emmc, uint32_t start, uint32_t count, const std::function<const uint8_t *(uint32_t index)> &page)
+{
+	uint32_t size = emmc ? 0x200 : 0x210;
+
+	std::mutex progress;
+	std::condition_variable changed;
+	bool credited = false;
+	uint32_t credit = 0;
+	uint32_t acked = 0;
+	std::vector<write_ack> failed;
+
+	// The first frame is the credit, every following one holds acks
+	auto frame = [&](const uint8_t *data, size_t length)
+	{
+		std::lock_guard<std::mutex> guard(progress);
+
+		size_t offset = 0;
+		if (!credited && length >= 4)
+		{
+			memcpy(&credit, data, 4);
+			credited = true;
+			offset = 4;
+		}
+
+		for (; offset + sizeof(write_ack) <= length; offset += sizeof(write_ack))
+		{
+			write_ack ack;
+			memcpy(&ack, data + offset, sizeof(ack));
+			if (ack.status)
+				failed.push_back(ack);
+			++acked;
+		}
+
+		changed.notify_all();
+	};
+
+	int64_t limit = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+	int64_t started = now_ns();
+
+	uint32_t pages = count;
+	std::future<reply> future = submit(emmc ? EMMC_WRITE_STREAM : WRITE_FLASH_STREAM, start, &pages, 4, frame);
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		std::unique_lock<std::mutex> guard(progress);
+		while (!credited || i - acked >= credit)
+		{
+			// Ended early by a frame error
+			if (future.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+			{
+				guard.unlock();
+				wait(future);
+				return failed;
+			}
+
+			changed.wait_for(guard, std::chrono::milliseconds(100));
+			if (now_ns() - std::max<int64_t>(started, last_rx) > limit)
+				throw error("timeout", i);
+		}
+		guard.unlock();
+
+		send(page(i), size);
+	}
+
+	wait(future);
+	return failed;
+}
+
+uint32_t device::write_block_data(uint32_t lba, const nand_block_meta &meta, const uint8_t *data, uint32_t pages, std::vector<uint8_t> *failed)
+{
+	write_block_data_args args = {pages, meta};
+	std::future<reply> future = submit(WRITE_FLASH_BLOCK_DATA, lba, &args, sizeof(args));
+	send(data, (size_t)pages * 0x200);
+
+	reply result = wait(future);
+	uint32_t status = reply_u32(result);
+	if (failed)
+		failed->assign(result.data.begin() + 4, result.data.end());
+	return status;
+}
+
+}
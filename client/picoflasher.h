@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __PICOFLASHER_H__
+#define __PICOFLASHER_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "protocol.h"
+
+// Host side of the framed protocol. Commands are written from the caller's
+// thread and may be pipelined up to caps.jobs_in_flight deep, a reader thread
+// matches the reply frames to them by seq and completes their futures.
+
+namespace picoflasher
+{
+
+struct reply
+{
+	uint16_t status = FRAME_OK;
+	std::vector<uint8_t> data;
+};
+
+// A frame status other than FRAME_OK, or a command status word
+class error : public std::runtime_error
+{
+public:
+	error(const std::string &what, uint32_t status) : std::runtime_error(what), status(status) {}
+
+	uint32_t status;
+};
+
+// Called on the reader thread for every frame of a request that has one,
+// instead of collecting the frames in reply.data
+typedef std::function<void(const uint8_t *data, size_t length)> frame_handler;
+
+// Called with every page of a read stream, size is 0x210 for NAND and 0x200
+// for eMMC
+typedef std::function<void(uint32_t lba, const uint8_t *page, uint32_t size)> page_handler;
+
+struct calibration
+{
+	smc_calibration result;
+	std::vector<smc_calibration_point> points;
+};
+
+struct bad_block_map
+{
+	bad_block_scan result;
+	std::vector<uint8_t> bitmap; // one bit per block, set if bad
+	std::vector<uint8_t> codes;	 // BAD_BLOCK_* of every block
+};
+
+class device
+{
+public:
+	// Opens a CDC tty, e.g. /dev/ttyACM0 or the simulator's pseudo terminals,
+	// or with a usbfs node, e.g. /dev/bus/usb/001/005, claims the vendor
+	// bulk interface instead (Linux only)
+	explicit device(const std::string &path);
+	~device();
+
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+
+	std::future<reply> submit(uint8_t cmd, uint32_t lba, const void *payload = nullptr, uint32_t length = 0, frame_handler handler = nullptr);
+
+	// Pages following a WRITE_FLASH_BLOCK or write stream header
+	void send(const void *data, size_t length);
+
+	// Waits for a submitted command, throws on a frame error or when nothing
+	// arrived from the device for timeout
+	reply wait(std::future<reply> &future);
+
+	uint32_t version();
+	uint32_t flash_config();
+	struct caps caps();
+	uint32_t set_stream_flags(uint32_t flags);
+
+	std::vector<uint8_t> read_page(uint32_t lba);
+	void write_page(uint32_t lba, const uint8_t *page);
+	std::vector<uint8_t> emmc_read(uint32_t lba);
+
+	// SMC_CALIBRATE reading back page lba, the device keeps the selected
+	// timing. result.status is not checked, the sweep is useful either way.
+	calibration calibrate(uint32_t lba);
+
+	// NAND_BAD_BLOCK_SCAN over the whole part
+	bad_block_map bad_block_scan();
+
+	// READ_FLASH_STREAM_RANGE / EMMC_READ_STREAM_RANGE, raw or compressed as
+	// set with set_stream_flags(). Returns the bytes that crossed the wire.
+	// With STREAM_FLAG_EDC the pages whose EDC did not match are still
+	// handed over, and their lbas added to edc_mismatch if given. With
+	// STREAM_FLAG_CONTINUE the pages that could not be read are skipped and
+	// added to failed.
+	uint64_t read_stream(bool emmc, uint32_t start, uint32_t count, page_handler handler, std::vector<uint32_t> *edc_mismatch = nullptr,
+						 std::vector<uint32_t> *failed = nullptr);
+
+	// READ_FLASH_SPARE_STREAM, handler gets the 0x10 byte spare of every page.
+	// Returns the bytes that crossed the wire.
+	uint64_t read_spare_map(uint32_t start, uint32_t count, page_handler handler);
+
+	// WRITE_FLASH_STREAM / EMMC_WRITE_STREAM, page(i) returns the i-th page.
+	// Returns the acks of the pages that failed.
+	std::vector<write_ack> write_stream(bool emmc, uint32_t start, uint32_t count, const std::function<const uint8_t *(uint32_t index)> &page);
+
+	// WRITE_FLASH_BLOCK_DATA of the erase block at lba from pages 0x200 byte
+	// data pages, the device builds the spares. Returns the u32 status
+	// and fills failed with a bit per page, set if it was not written.
+	uint32_t write_block_data(uint32_t lba, const nand_block_meta &meta, const uint8_t *data, uint32_t pages, std::vector<uint8_t> *failed = nullptr);
+
+	std::chrono::milliseconds timeout{10000};
+
+private:
+	struct pending
+	{
+		std::promise<reply> promise;
+		reply result;
+		frame_handler handler;
+		bool stream;
+	};
+
+	ssize_t read_some(void *data, size_t length);
+	ssize_t write_some(const void *data, size_t length);
+	void write_all(const void *data, size_t length);
+	void reader_main();
+	void dispatch(const frame_reply &header, const uint8_t *data);
+	reply call(uint8_t cmd, uint32_t lba = 0, const void *payload = nullptr, uint32_t length = 0);
+
+	int fd;
+	bool usbfs = false;
+	std::thread reader;
+	std::atomic<bool> stopping{false};
+	std::atomic<int64_t> last_rx;
+
+	std::mutex write_lock; // seq order is wire order
+	std::mutex lock;	   // requests, held while handlers run
+	uint16_t next_seq = 1;
+	std::map<uint16_t, pending> requests;
+
+	uint32_t stream_flags = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,45 @@
+static const uint32_t edc_table[256] = {
+	0x00000000, 0x005b6b3a, 0x00b6d674, 0x00edbd4e, 0x016dace8, 0x0136c7d2,
+	0x01db7a9c, 0x018011a6, 0x02db59d0, 0x028032ea, 0x026d8fa4, 0x0236e49e,
+	0x03b6f538, 0x03ed9e02, 0x0300234c, 0x035b4876, 0x0323f6f9, 0x03789dc3,
+	0x0395208d, 0x03ce4bb7, 0x024e5a11, 0x0215312b, 0x02f88c65, 0x02a3e75f,
+	0x01f8af29, 0x01a3c413, 0x014e795d, 0x01151267, 0x009503c1, 0x00ce68fb,
+	0x0023d5b5, 0x0078be8f, 0x00d2a8ab, 0x0089c391, 0x00647edf, 0x003f15e5,
+	0x01bf0443, 0x01e46f79, 0x0109d237, 0x0152b90d, 0x0209f17b, 0x02529a41,
+	0x02bf270f, 0x02e44c35, 0x03645d93, 0x033f36a9, 0x03d28be7, 0x0389e0dd,
+	0x03f15e52, 0x03aa3568, 0x03478826, 0x031ce31c, 0x029cf2ba, 0x02c79980,
+	0x022a24ce, 0x02714ff4, 0x012a0782, 0x01716cb8, 0x019cd1f6, 0x01c7bacc,
+	0x0047ab6a, 0x001cc050, 0x00f17d1e, 0x00aa1624, 0x01a55156, 0x01fe3a6c,
+	0x01138722, 0x0148ec18, 0x00c8fdbe, 0x00939684, 0x007e2bca, 0x002540f0,
+	0x037e0886, 0x032563bc, 0x03c8def2, 0x0393b5c8, 0x0213a46e, 0x0248cf54,
+	0x02a5721a, 0x02fe1920, 0x0286a7af, 0x02ddcc95, 0x023071db, 0x026b1ae1,
+	0x03eb0b47, 0x03b0607d, 0x035ddd33, 0x0306b609, 0x005dfe7f, 0x00069545,
+	0x00eb280b, 0x00b04331, 0x01305297, 0x016b39ad, 0x018684e3, 0x01ddefd9,
+	0x0177f9fd, 0x012c92c7, 0x01c12f89, 0x019a44b3, 0x001a5515, 0x00413e2f,
+	0x00ac8361, 0x00f7e85b, 0x03aca02d, 0x03f7cb17, 0x031a7659, 0x03411d63,
+	0x02c10cc5, 0x029a67ff, 0x0277dab1, 0x022cb18b, 0x02540f04, 0x020f643e,
+	0x02e2d970, 0x02b9b24a, 0x0339a3ec, 0x0362c8d6, 0x038f7598, 0x03d41ea2,
+	0x008f56d4, 0x00d43dee, 0x003980a0, 0x0062eb9a, 0x01e2fa3c, 0x01b99106,
+	0x01542c48, 0x010f4772, 0x034aa2ac, 0x0311c996, 0x03fc74d8, 0x03a71fe2,
+	0x02270e44, 0x027c657e, 0x0291d830, 0x02cab30a, 0x0191fb7c, 0x01ca9046,
+	0x01272d08, 0x017c4632, 0x00fc5794, 0x00a73cae, 0x004a81e0, 0x0011eada,
+	0x00695455, 0x00323f6f, 0x00df8221, 0x0084e91b, 0x0104f8bd, 0x015f9387,
+	0x01b22ec9, 0x01e945f3, 0x02b20d85, 0x02e966bf, 0x0204dbf1, 0x025fb0cb,
+	0x03dfa16d, 0x0384ca57, 0x03697719, 0x03321c23, 0x03980a07, 0x03c3613d,
+	0x032edc73, 0x0375b749, 0x02f5a6ef, 0x02aecdd5, 0x0243709b, 0x02181ba1,
+	0x014353d7, 0x011838ed, 0x01f585a3, 0x01aeee99, 0x002eff3f, 0x00759405,
+	0x0098294b, 0x00c34271, 0x00bbfcfe, 0x00e097c4, 0x000d2a8a, 0x005641b0,
+	0x01d65016, 0x018d3b2c, 0x01608662, 0x013bed58, 0x0260a52e, 0x023bce14,
+	0x02d6735a, 0x028d1860, 0x030d09c6, 0x035662fc, 0x03bbdfb2, 0x03e0b488,
+	0x02eff3fa, 0x02b498c0, 0x0259258e, 0x02024eb4, 0x03825f12, 0x03d93428,
+	0x03348966, 0x036fe25c, 0x0034aa2a, 0x006fc110, 0x00827c5e, 0x00d91764,
+	0x015906c2, 0x01026df8, 0x01efd0b6, 0x01b4bb8c, 0x01cc0503, 0x01976e39,
+	0x017ad377, 0x0121b84d, 0x00a1a9eb, 0x00fac2d1, 0x00177f9f, 0x004c14a5,
+	0x03175cd3, 0x034c37e9, 0x03a18aa7, 0x03fae19d, 0x027af03b, 0x02219b01,
+	0x02cc264f, 0x02974d75, 0x023d5b51, 0x0266306b, 0x028b8d25, 0x02d0e61f,
+	0x0350f7b9, 0x030b9c83, 0x03e621cd, 0x03bd4af7, 0x00e60281, 0x00bd69bb,
+	0x0050d4f5, 0x000bbfcf, 0x018bae69, 0x01d0c553, 0x013d781d, 0x01661327,
+	0x011eada8, 0x0145c692, 0x01a87bdc, 0x01f310e6, 0x00730140, 0x00286a7a,
+	0x00c5d734, 0x009ebc0e, 0x03c5f478, 0x039e9f42, 0x0373220c, 0x03284936,
+	0x02a85890, 0x02f333aa, 0x021e8ee4, 0x0245e5de
+};
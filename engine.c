@@ -0,0 +1,635 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "pico/bootrom.h"
+
+#include "protocol.h"
+#include "engine.h"
+#include "xbox.h"
+#include "isd1200.h"
+#include "sdio.h"
+#include "pins.h"
+#include "perf.h"
+#include "stream.h"
+#include "host.h"
+#include "checksum.h"
+#include "calibrate.h"
+#include "badblock.h"
+#include "msc.h"
+#include "trace.h"
+
+static struct job job_slots[8];
+static struct reply reply_slots[SDIO_MAX_BLOCK_COUNT * 2];
+
+struct queue engine_jobs = QUEUE_INIT(job_slots);
+struct queue engine_replies = QUEUE_INIT(reply_slots);
+
+static uint32_t core1_stack[2048];
+
+// SMC start/stop from the USB callbacks, core0 sets smc_run and then bumps
+// smc_requests so it never waits on a full job queue
+static volatile bool smc_run = false;
+static volatile uint32_t smc_requests = 0;
+static uint32_t smc_handled = 0;
+
+static struct reply *reply_current = NULL;
+static struct job *reply_job = NULL;
+static bool reply_ends = true;
+static uint16_t reply_status = FRAME_OK;
+
+static void reply_acquire()
+{
+	while (!(reply_current = queue_acquire(&engine_replies)))
+		tight_loop_contents();
+
+	reply_current->length = 0;
+	reply_current->flags = reply_job->framed ? REPLY_FRAMED : 0;
+	reply_current->port = reply_job->port;
+	reply_current->generation = 0;
+	reply_current->seq = reply_job->seq;
+	reply_current->status = FRAME_OK;
+}
+
+void reply_write(const void *data, uint32_t length)
+{
+	const uint8_t *src = data;
+
+	while (length)
+	{
+		if (!reply_current)
+			reply_acquire();
+
+		uint32_t chunk = sizeof(reply_current->data) - reply_current->length;
+		if (chunk > length)
+			chunk = length;
+
+		memcpy(&reply_current->data[reply_current->length], src, chunk);
+		reply_current->length += chunk;
+		src += chunk;
+		length -= chunk;
+
+		if (reply_current->length == sizeof(reply_current->data))
+			reply_flush();
+	}
+}
+
+void reply_flush()
+{
+	if (reply_current)
+	{
+		queue_commit(&engine_replies);
+		reply_current = NULL;
+	}
+}
+
+// The current job completes its reply, also for the commands whose reply
+// only comes with their last page
+void reply_end()
+{
+	reply_ends = true;
+}
+
+// A framed reply always ends with a FRAME_END frame, even if empty
+static void reply_finish()
+{
+	if (reply_job->framed && reply_ends)
+	{
+		if (!reply_current)
+			reply_acquire();
+
+		reply_current->flags |= REPLY_END;
+		reply_current->status = reply_status;
+	}
+
+	reply_flush();
+}
+
+static bool emmc_detected = false;
+static uint8_t emmc_ext_csd[512] __attribute__((aligned(4)));
+static uint32_t emmc_sectors = 0; // SEC_COUNT, once EMMC_INIT succeeded
+
+// WRITE_FLASH_BLOCK(_DATA) in progress, fed by WRITE_FLASH_BLOCK(_DATA)_PAGE
+// jobs
+static struct
+{
+	uint32_t lba;
+	uint32_t pages;
+	uint32_t done;
+	uint32_t status;
+	bool skip;
+	bool build_spare;
+	struct nand_block_meta meta;
+	uint8_t failed[WRITE_FLASH_BLOCK_MAX_PAGES / 8];
+} block;
+
+static void block_finish()
+{
+	uint32_t pages = block.pages;
+	if (pages > WRITE_FLASH_BLOCK_MAX_PAGES)
+		pages = WRITE_FLASH_BLOCK_MAX_PAGES;
+
+	reply_write(&block.status, 4);
+	reply_write(block.failed, (pages + 7) / 8);
+	reply_end();
+}
+
+static void block_start(uint32_t lba, uint32_t pages, const struct nand_block_meta *meta)
+{
+	block.lba = lba;
+	block.pages = pages;
+	block.done = 0;
+	block.status = 0;
+	block.build_spare = meta != NULL;
+	if (meta)
+		block.meta = *meta;
+
+	// A rejected block or failed erase marks every page failed, the pages
+	// that follow are still drained so the host stays in sync. core0 skips
+	// the pages of a block longer than any.
+	if (pages > WRITE_FLASH_BLOCK_MAX_PAGES)
+		block.pages = pages = 0;
+	if (!pages || pages != xbox_nand_pages_per_block() || lba % pages)
+		block.status = WRITE_FLASH_BLOCK_BAD_GEOMETRY;
+	else
+		block.status = xbox_nand_erase_block(lba);
+
+	block.skip = block.status != 0;
+	memset(block.failed, block.skip ? 0xFF : 0x00, sizeof(block.failed));
+
+	if (pages == 0)
+		block_finish();
+}
+
+static void block_page(uint8_t *page)
+{
+	if (block.done >= block.pages)
+		return;
+
+	uint32_t index = block.done++;
+
+	if (!block.skip && index < WRITE_FLASH_BLOCK_MAX_PAGES)
+	{
+		// The job payload has room for the spare behind the data
+		if (block.build_spare)
+			xbox_nand_build_spare(page, &page[0x200], &block.meta);
+
+		uint32_t ret = xbox_nand_program_page(block.lba + index, page, &page[0x200]);
+		if (ret)
+		{
+			block.failed[index / 8] |= 1 << (index % 8);
+			if (!block.status)
+				block.status = ret;
+		}
+	}
+
+	if (block.done == block.pages)
+		block_finish();
+}
+
+// WRITE_FLASH_STREAM / EMMC_WRITE_STREAM in progress
+static struct
+{
+	bool emmc;
+	uint32_t next;
+	uint32_t remaining;
+} write_stream;
+
+static void write_stream_start(bool emmc, uint32_t lba, uint32_t count)
+{
+	write_stream.emmc = emmc;
+	write_stream.next = lba;
+	write_stream.remaining = count;
+
+	// Nothing may follow a rejected stream, core0 stops waiting for its pages
+	uint32_t size = emmc ? emmc_sectors : xbox_nand_pages();
+	if (lba > size || count > size - lba)
+	{
+		write_stream.remaining = 0;
+		if (count)
+			host_pages_cancel(reply_job->port);
+
+		uint32_t credit = 0;
+		if (reply_job->framed)
+			reply_status = FRAME_BAD_COUNT;
+		else
+			reply_write(&credit, 4);
+		reply_end();
+		return;
+	}
+
+	uint32_t credit = WRITE_STREAM_CREDIT;
+	reply_write(&credit, 4);
+
+	if (!count)
+		reply_end();
+}
+
+static void write_stream_page(uint8_t *page)
+{
+	if (!write_stream.remaining)
+		return;
+
+	struct write_ack ack;
+	ack.lba = write_stream.next++;
+	--write_stream.remaining;
+
+	if (write_stream.emmc)
+		ack.status = sd_writeblocks_sync(page, ack.lba, 1);
+	else
+		ack.status = xbox_nand_write_block(ack.lba, page, &page[0x200]);
+
+	reply_write(&ack, sizeof(ack));
+
+	if (!write_stream.remaining)
+		reply_end();
+}
+
+static const uint8_t supported_commands[] =
+{
+	GET_VERSION, GET_FLASH_CONFIG, READ_FLASH, WRITE_FLASH, READ_FLASH_STREAM, READ_FLASH_STREAM_RANGE,
+	GET_STREAM_STATS, WRITE_FLASH_BLOCK, WRITE_FLASH_STREAM, SET_STREAM_FLAGS, FLASH_CHECKSUM, FLASH_DIFF, GET_CAPS,
+	GET_STATS, TRACE_DUMP, SMC_CALIBRATE, READ_FLASH_SPARE_STREAM, NAND_BAD_BLOCK_SCAN, WRITE_FLASH_BLOCK_DATA,
+	EMMC_DETECT, EMMC_INIT, EMMC_GET_CID, EMMC_GET_CSD, EMMC_GET_EXT_CSD, EMMC_READ, EMMC_READ_STREAM, EMMC_WRITE,
+	EMMC_READ_STREAM_RANGE, EMMC_WRITE_STREAM, EMMC_CHECKSUM,
+	ISD1200_INIT, ISD1200_DEINIT, ISD1200_READ_ID, ISD1200_READ_FLASH, ISD1200_ERASE_FLASH, ISD1200_WRITE_FLASH,
+	ISD1200_PLAY_VOICE, ISD1200_EXEC_MACRO, ISD1200_RESET,
+	REBOOT_TO_BOOTLOADER
+};
+
+static void get_caps()
+{
+	struct caps caps;
+	memset(&caps, 0, sizeof(caps));
+
+	caps.version = CAPS_VERSION;
+	caps.firmware_version = 4;
+	caps.frame_version = FRAME_VERSION;
+	caps.max_payload = sizeof(((struct job *)0)->payload);
+	caps.max_reply = REPLY_DATA_SIZE;
+	caps.jobs_in_flight = engine_jobs.count;
+	caps.write_credit = WRITE_STREAM_CREDIT;
+	caps.emmc_batch = SDIO_MAX_BLOCK_COUNT;
+	caps.diff_blocks = FLASH_DIFF_MAX_BLOCKS;
+	caps.stream_flags = STREAM_FLAG_COMPRESS | STREAM_FLAG_EDC | STREAM_FLAG_CONTINUE | STREAM_RETRIES_MASK;
+
+	for (uint32_t i = 0; i < sizeof(supported_commands); ++i)
+		caps.commands[supported_commands[i] / 8] |= 1 << (supported_commands[i] % 8);
+
+	reply_write(&caps, sizeof(caps));
+}
+
+static void get_stats(bool reset)
+{
+	uint32_t count = PERF_COUNT;
+	reply_write(&count, 4);
+
+	for (uint32_t i = 0; i < PERF_COUNT; ++i)
+	{
+		struct perf_stat stat;
+		stat.count = perf_counters[i].count;
+		stat.min = perf_counters[i].min;
+		stat.max = perf_counters[i].max;
+		stat.total = perf_counters[i].total;
+		reply_write(&stat, sizeof(stat));
+	}
+
+	if (reset)
+		perf_counters_reset();
+}
+
+static void engine_execute(struct job *job)
+{
+	if (job->cmd == GET_VERSION)
+	{
+		uint32_t ver = 4;
+		reply_write(&ver, 4);
+	}
+	else if (job->cmd == GET_FLASH_CONFIG)
+	{
+		uint32_t fc = xbox_get_flash_config();
+		reply_write(&fc, 4);
+	}
+	else if (job->cmd == READ_FLASH)
+	{
+		static uint8_t buffer[0x210] __attribute__((aligned(4)));
+		uint32_t ret = xbox_nand_read_block(job->lba, buffer, &buffer[0x200]);
+		reply_write(&ret, 4);
+		if (ret == 0)
+			reply_write(buffer, sizeof(buffer));
+	}
+	else if (job->cmd == WRITE_FLASH)
+	{
+		uint32_t ret = xbox_nand_write_block(job->lba, job->payload, &job->payload[0x200]);
+		reply_write(&ret, 4);
+	}
+	else if (job->cmd == WRITE_FLASH_BLOCK)
+	{
+		block_start(job->lba, *(uint32_t *)job->payload, NULL);
+	}
+	else if (job->cmd == WRITE_FLASH_BLOCK_DATA)
+	{
+		struct write_block_data_args *args = (struct write_block_data_args *)job->payload;
+		block_start(job->lba, args->count, &args->meta);
+	}
+	else if (job->cmd == WRITE_FLASH_BLOCK_PAGE || job->cmd == WRITE_FLASH_BLOCK_DATA_PAGE)
+	{
+		block_page(job->payload);
+	}
+	else if (job->cmd == WRITE_FLASH_STREAM)
+	{
+		write_stream_start(false, job->lba, *(uint32_t *)job->payload);
+	}
+	else if (job->cmd == WRITE_FLASH_STREAM_PAGE)
+	{
+		write_stream_page(job->payload);
+	}
+	else if (job->cmd == READ_FLASH_STREAM)
+	{
+		stream_start(STREAM_NAND, job, 0, job->lba);
+	}
+	else if (job->cmd == READ_FLASH_STREAM_RANGE)
+	{
+		stream_start(STREAM_NAND, job, job->lba, *(uint32_t *)job->payload);
+	}
+	else if (job->cmd == READ_FLASH_SPARE_STREAM)
+	{
+		stream_start(STREAM_NAND_SPARE, job, job->lba, *(uint32_t *)job->payload);
+	}
+	else if (job->cmd == SET_STREAM_FLAGS)
+	{
+		stream_set_flags(job->lba);
+		uint32_t flags = stream_get_flags();
+		reply_write(&flags, 4);
+	}
+	else if (job->cmd == FLASH_CHECKSUM)
+	{
+		struct checksum_args *args = (struct checksum_args *)job->payload;
+		checksum_nand(job->lba, args->count, args->chunk);
+	}
+	else if (job->cmd == FLASH_DIFF)
+	{
+		flash_diff(job->lba, (struct flash_diff_args *)job->payload);
+	}
+	else if (job->cmd == GET_CAPS)
+	{
+		get_caps();
+	}
+	else if (job->cmd == GET_STATS)
+	{
+		get_stats(job->lba & GET_STATS_RESET);
+	}
+	else if (job->cmd == TRACE_DUMP)
+	{
+		trace_dump(job->lba & TRACE_DUMP_CLEAR);
+	}
+	else if (job->cmd == SMC_CALIBRATE)
+	{
+		smc_calibrate(job->lba);
+	}
+	else if (job->cmd == NAND_BAD_BLOCK_SCAN)
+	{
+		bad_block_scan();
+	}
+	else if (job->cmd == GET_STREAM_STATS)
+	{
+		struct stream_stats stats;
+		stream_get_stats(&stats);
+		reply_write(&stats, sizeof(stats));
+	}
+	else if (job->cmd == ISD1200_INIT)
+	{
+		uint8_t ret = isd1200_init() ? 0 : 1;
+		reply_write(&ret, 1);
+	}
+	else if (job->cmd == ISD1200_DEINIT)
+	{
+		isd1200_deinit();
+		uint8_t ret = 0;
+		reply_write(&ret, 1);
+	}
+	else if (job->cmd == ISD1200_READ_ID)
+	{
+		uint8_t dev_id = isd1200_read_id();
+		reply_write(&dev_id, 1);
+	}
+	else if (job->cmd == ISD1200_READ_FLASH)
+	{
+		static uint8_t buffer[512];
+		isd1200_flash_read(job->lba, buffer);
+		reply_write(buffer, sizeof(buffer));
+	}
+	else if (job->cmd == ISD1200_ERASE_FLASH)
+	{
+		isd1200_chip_erase();
+		uint8_t ret = 0;
+		reply_write(&ret, 1);
+	}
+	else if (job->cmd == ISD1200_WRITE_FLASH)
+	{
+		isd1200_flash_write(job->lba, job->payload);
+		uint32_t ret = 0;
+		reply_write(&ret, 4);
+	}
+	else if (job->cmd == ISD1200_PLAY_VOICE)
+	{
+		isd1200_play_vp(job->lba);
+		uint8_t ret = 0;
+		reply_write(&ret, 1);
+	}
+	else if (job->cmd == ISD1200_EXEC_MACRO)
+	{
+		isd1200_exe_vm(job->lba);
+		uint8_t ret = 0;
+		reply_write(&ret, 1);
+	}
+	else if (job->cmd == ISD1200_RESET)
+	{
+		isd1200_reset();
+		uint8_t ret = 0;
+		reply_write(&ret, 1);
+	}
+	else if (job->cmd == REBOOT_TO_BOOTLOADER)
+	{
+		reset_usb_boot(0, 0);
+	}
+	else if (job->cmd == EMMC_DETECT)
+	{
+		if (!emmc_detected)
+		{
+			gpio_init(MMC_CLK_PIN);
+			gpio_set_dir(MMC_CLK_PIN, GPIO_IN);
+			emmc_detected = gpio_get(MMC_CLK_PIN);
+		}
+		reply_write(&emmc_detected, 1);
+	}
+	else if (job->cmd == EMMC_INIT)
+	{
+		// Put SMC into reset
+		gpio_init(SMC_RST_XDK_N);
+		gpio_set_dir(SMC_RST_XDK_N, GPIO_OUT);
+		gpio_put(SMC_RST_XDK_N, 0);
+
+		uint32_t ret = sd_init();
+		reply_write(&ret, 4);
+
+		// SEC_COUNT, the card shows up as the eMMC LUN from now on
+		emmc_sectors = 0;
+		if (ret == 0 && sd_read_ext_csd(emmc_ext_csd) == 0)
+			memcpy(&emmc_sectors, &emmc_ext_csd[212], 4);
+		msc_emmc_attach(emmc_sectors);
+	}
+	else if (job->cmd == EMMC_GET_CID)
+	{
+		uint8_t cid_raw[16];
+		sd_read_cid(cid_raw);
+		reply_write(cid_raw, sizeof(cid_raw));
+	}
+	else if (job->cmd == EMMC_GET_CSD)
+	{
+		uint8_t csd_raw[16];
+		sd_read_csd(csd_raw);
+		reply_write(csd_raw, sizeof(csd_raw));
+	}
+	else if (job->cmd == EMMC_GET_EXT_CSD)
+	{
+		sd_read_ext_csd(emmc_ext_csd);
+		reply_write(emmc_ext_csd, sizeof(emmc_ext_csd));
+	}
+	else if (job->cmd == EMMC_READ)
+	{
+		static uint8_t buffer[0x200] __attribute__((aligned(4)));
+		int ret = sd_readblocks_sync(buffer, job->lba, 1);
+		reply_write(&ret, 4);
+		if (ret == 0)
+			reply_write(buffer, sizeof(buffer));
+	}
+	else if (job->cmd == EMMC_READ_STREAM)
+	{
+		stream_start(STREAM_EMMC, job, 0, job->lba);
+	}
+	else if (job->cmd == EMMC_READ_STREAM_RANGE)
+	{
+		stream_start(STREAM_EMMC, job, job->lba, *(uint32_t *)job->payload);
+	}
+	else if (job->cmd == EMMC_WRITE_STREAM)
+	{
+		write_stream_start(true, job->lba, *(uint32_t *)job->payload);
+	}
+	else if (job->cmd == EMMC_WRITE_STREAM_PAGE)
+	{
+		write_stream_page(job->payload);
+	}
+	else if (job->cmd == EMMC_CHECKSUM)
+	{
+		struct checksum_args *args = (struct checksum_args *)job->payload;
+		checksum_emmc(job->lba, args->count, args->chunk);
+	}
+	else if (job->cmd == EMMC_WRITE)
+	{
+		uint32_t ret = sd_writeblocks_sync(job->payload, job->lba, 1);
+		reply_write(&ret, 4);
+	}
+	else if (job->cmd == MSC_TRANSFER)
+	{
+		msc_execute(job->lba, (struct msc_request *)job->payload);
+	}
+	else if (job->cmd == FRAME_REJECT)
+	{
+		reply_status = job->lba;
+	}
+	else
+	{
+		reply_status = FRAME_UNSUPPORTED;
+	}
+}
+
+static void engine_smc(bool run)
+{
+	if (run)
+	{
+		msc_nand_attach(false);
+		xbox_start_smc();
+		trace(TRACE_SMC, 0, 0);
+
+		printf("Bye!\n");
+	}
+	else
+	{
+		xbox_stop_smc();
+		trace(TRACE_SMC, 0, 1);
+
+		uint32_t flash_config = xbox_get_flash_config();
+
+		printf("flash_config: %x\n", flash_config);
+
+		msc_nand_attach(flash_config != 0 && flash_config != 0xFFFFFFFF);
+	}
+}
+
+static void engine_main()
+{
+	perf_init();
+
+	while (1)
+	{
+		// Only the latest request counts, the bus ends up where the host left it
+		if (smc_requests != smc_handled)
+		{
+			smc_handled = smc_requests;
+			__dmb();
+			stream_wait();
+			engine_smc(smc_run);
+		}
+
+		struct job *job = queue_peek(&engine_jobs);
+		if (job)
+		{
+			// An eMMC batch in flight owns both the bus and the head of
+			// the reply queue, let it land before running anything else.
+			stream_wait();
+
+			reply_job = job;
+			reply_ends = !cmd_page_command(job->cmd) && !cmd_is_page(job->cmd) && !cmd_starts_stream(job->cmd);
+			reply_status = FRAME_OK;
+
+			trace(TRACE_CMD_START, job->lba, job->cmd);
+			engine_execute(job);
+			reply_finish();
+			trace(TRACE_CMD_END, 0, job->cmd);
+			queue_release(&engine_jobs);
+		}
+
+		stream_task();
+	}
+}
+
+void engine_launch()
+{
+	multicore_launch_core1_with_stack(engine_main, core1_stack, sizeof(core1_stack));
+}
+
+// Used by the USB callbacks on core0
+void engine_request_smc(bool run)
+{
+	smc_run = run;
+	__dmb();
+	++smc_requests;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "queue.h"
+#include "protocol.h"
+
+// Core0 runs TinyUSB and forwards every command to core1 as a job. Core1 owns
+// the flash backends and sends everything for the host back as replies, so
+// command replies and stream data stay in order.
+
+// A page with room in front for the headers of a compressed stream
+#define REPLY_DATA_SIZE (0x210 + 2 * sizeof(struct stream_record))
+
+// reply.flags
+#define REPLY_STREAM 0x01 // dropped by core0 if a newer stream was requested
+#define REPLY_FRAMED 0x02 // sent with a frame_reply header
+#define REPLY_END 0x04	  // FRAME_END
+
+struct job
+{
+	uint8_t cmd;
+	uint8_t port;
+	bool framed;
+	uint16_t seq;
+	uint32_t lba;
+	uint32_t generation;
+	uint32_t length;
+	uint8_t payload[0x210] __attribute__((aligned(4)));
+};
+
+struct reply
+{
+	uint16_t length;
+	uint8_t flags;
+	uint8_t port; // enum host_port
+	uint32_t generation;
+	uint16_t seq;
+	uint16_t status; // frame_reply.status
+	uint8_t data[REPLY_DATA_SIZE] __attribute__((aligned(4)));
+};
+
+extern struct queue engine_jobs;
+extern struct queue engine_replies;
+
+void engine_launch();
+void engine_request_smc(bool run); // never blocks
+
+// core1 only
+void reply_write(const void *data, uint32_t length);
+void reply_flush();
+void reply_end();
+
+#endif
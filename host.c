@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pico/stdlib.h"
+#include "tusb.h"
+#include "protocol.h"
+#include "engine.h"
+#include "stream.h"
+#include "host.h"
+#include "perf.h"
+#include "trace.h"
+
+static uint32_t host_available(uint8_t port)
+{
+	return port == PORT_CDC ? tud_cdc_available() : tud_vendor_available();
+}
+
+static bool host_peek(uint8_t port, uint8_t *byte)
+{
+	return port == PORT_CDC ? tud_cdc_peek(byte) : tud_vendor_peek(byte);
+}
+
+static uint32_t host_read(uint8_t port, void *buffer, uint32_t length)
+{
+	return port == PORT_CDC ? tud_cdc_read(buffer, length) : tud_vendor_read(buffer, length);
+}
+
+static uint32_t host_write(uint8_t port, const void *buffer, uint32_t length)
+{
+	return port == PORT_CDC ? tud_cdc_write(buffer, length) : tud_vendor_write(buffer, length);
+}
+
+static void host_flush(uint8_t port)
+{
+	if (port == PORT_CDC)
+		tud_cdc_write_flush();
+	else
+		tud_vendor_write_flush();
+}
+
+uint32_t host_write_available(uint8_t port)
+{
+	return port == PORT_CDC ? tud_cdc_write_available() : tud_vendor_write_available();
+}
+
+// Pages still expected after a WRITE_FLASH_BLOCK or write stream header
+static struct
+{
+	uint8_t cmd;
+	uint32_t count;
+	bool framed;
+	uint16_t seq;
+} pages[PORT_COUNT];
+
+// Bumped by core1 for a write stream it rejected, the host sends none of its
+// pages
+static volatile uint32_t page_cancels[PORT_COUNT];
+static uint32_t page_cancels_seen[PORT_COUNT];
+
+void host_pages_cancel(uint8_t port)
+{
+	__dmb();
+	++page_cancels[port];
+}
+
+// Framed command whose header has been read, and bytes of a rejected frame
+// still to be skipped. A length no command could have is not trusted, the
+// input is skipped up to the next FRAME_MAGIC instead.
+static struct
+{
+	struct frame header;
+	bool valid;
+	bool resync;
+	uint32_t discard;
+} frames[PORT_COUNT];
+
+static struct job *host_job(uint8_t port, uint8_t cmd, uint32_t lba, uint32_t length, bool framed, uint16_t seq)
+{
+	struct job *job = queue_acquire(&engine_jobs);
+	if (!job)
+		return NULL;
+
+	job->cmd = cmd;
+	job->port = port;
+	job->framed = framed;
+	job->seq = seq;
+	job->lba = lba;
+	job->generation = stream_generation;
+	job->length = length;
+	return job;
+}
+
+// Written pages go to core1 one job each, so a whole block never has to fit
+// into memory and programming overlaps with the transfer of the next pages.
+static bool host_rx_page(uint8_t port)
+{
+	uint32_t length = cmd_payload_length(pages[port].cmd);
+	if (host_available(port) < length)
+		return false;
+
+	struct job *job = host_job(port, pages[port].cmd, 0, length, pages[port].framed, pages[port].seq);
+	if (!job)
+		return false;
+
+	host_read(port, job->payload, length);
+	queue_commit(&engine_jobs);
+
+	--pages[port].count;
+	return true;
+}
+
+// Payload already read into the job
+static void host_rx_command(uint8_t port, struct job *job)
+{
+	// core1 checks the count against the flash and answers a bad one. What
+	// the host sends of a block longer than any erase block is skipped, the
+	// pages of any other rejected block are drained by core1.
+	if (cmd_page_command(job->cmd))
+	{
+		uint8_t cmd = cmd_page_command(job->cmd);
+		uint32_t count = *(uint32_t *)job->payload;
+		if (cmd_is_block_page(cmd) && count > WRITE_FLASH_BLOCK_MAX_PAGES)
+		{
+			frames[port].discard = WRITE_FLASH_BLOCK_MAX_PAGES * cmd_payload_length(cmd);
+		}
+		else
+		{
+			pages[port].cmd = cmd;
+			pages[port].count = count;
+			pages[port].framed = job->framed;
+			pages[port].seq = job->seq;
+		}
+	}
+
+	if (cmd_starts_stream(job->cmd))
+	{
+		stream_cancel();
+		job->generation = stream_generation;
+	}
+
+	queue_commit(&engine_jobs);
+}
+
+static bool host_rx_frame(uint8_t port)
+{
+	struct frame *frame = &frames[port].header;
+
+	if (!frames[port].valid)
+	{
+		if (host_available(port) < sizeof(*frame))
+			return false;
+
+		host_read(port, frame, sizeof(*frame));
+		frames[port].valid = true;
+	}
+
+	uint16_t status = FRAME_OK;
+	if (frame->version != FRAME_VERSION)
+		status = FRAME_BAD_VERSION;
+	else if (cmd_internal(frame->cmd))
+		status = FRAME_UNSUPPORTED;
+	else if (frame->length != cmd_payload_length(frame->cmd))
+		status = FRAME_BAD_LENGTH;
+
+	// The payload of a bad frame is skipped, core1 answers it in order
+	if (status != FRAME_OK)
+	{
+		struct job *job = host_job(port, FRAME_REJECT, status, 0, true, frame->seq);
+		if (!job)
+			return false;
+
+		queue_commit(&engine_jobs);
+		if (frame->length > sizeof(job->payload))
+			frames[port].resync = true;
+		else
+			frames[port].discard = frame->length;
+		frames[port].valid = false;
+		return true;
+	}
+
+	if (host_available(port) < frame->length)
+		return false;
+
+	struct job *job = host_job(port, frame->cmd, frame->lba, frame->length, true, frame->seq);
+	if (!job)
+		return false;
+
+	host_read(port, job->payload, frame->length);
+	host_rx_command(port, job);
+
+	frames[port].valid = false;
+	return true;
+}
+
+static bool host_rx_discard(uint8_t port)
+{
+	uint8_t scratch[64];
+
+	uint32_t length = host_available(port);
+	if (length > frames[port].discard)
+		length = frames[port].discard;
+	if (length > sizeof(scratch))
+		length = sizeof(scratch);
+	if (!length)
+		return false;
+
+	host_read(port, scratch, length);
+	frames[port].discard -= length;
+	return true;
+}
+
+static bool host_rx_resync(uint8_t port)
+{
+	uint8_t byte;
+	if (!host_available(port) || !host_peek(port, &byte))
+		return false;
+
+	if (byte == FRAME_MAGIC)
+		frames[port].resync = false;
+	else
+		host_read(port, &byte, 1);
+	return true;
+}
+
+// Hands complete commands over to the flash engine on core1
+static void host_rx_task(uint8_t port)
+{
+	while (1)
+	{
+		bool progress;
+
+		if (page_cancels[port] != page_cancels_seen[port])
+		{
+			page_cancels_seen[port] = page_cancels[port];
+			pages[port].count = 0;
+		}
+
+		if (frames[port].resync)
+			progress = host_rx_resync(port);
+		else if (frames[port].discard)
+			progress = host_rx_discard(port);
+		else if (pages[port].count)
+			progress = host_rx_page(port);
+		else if (frames[port].valid)
+			progress = host_rx_frame(port);
+		else
+		{
+			uint8_t op;
+			if (!host_available(port) || !host_peek(port, &op))
+				return;
+
+			if (op == FRAME_MAGIC)
+			{
+				progress = host_rx_frame(port);
+			}
+			else if (cmd_internal(op))
+			{
+				// Only the header is dropped, there is no payload to expect
+				struct cmd cmd;
+				if (host_available(port) < sizeof(cmd))
+					return;
+
+				host_read(port, &cmd, sizeof(cmd));
+				progress = true;
+			}
+			else
+			{
+				uint32_t payload = cmd_payload_length(op);
+				if (host_available(port) < sizeof(struct cmd) + payload)
+					return;
+
+				struct job *job = host_job(port, op, 0, payload, false, 0);
+				if (!job)
+					return;
+
+				struct cmd cmd;
+				host_read(port, &cmd, sizeof(cmd));
+				host_read(port, job->payload, payload);
+
+				job->lba = cmd.lba;
+				host_rx_command(port, job);
+				progress = true;
+			}
+		}
+
+		if (!progress)
+			return;
+	}
+}
+
+static bool host_tx_reply(struct reply *reply)
+{
+	if (!(reply->flags & REPLY_FRAMED))
+	{
+		if (host_write_available(reply->port) < reply->length)
+			return false;
+
+		host_write(reply->port, reply->data, reply->length);
+		return true;
+	}
+
+	struct frame_reply frame;
+	frame.magic = FRAME_REPLY_MAGIC;
+	frame.flags = 0;
+	if (reply->flags & REPLY_END)
+		frame.flags |= FRAME_END;
+	if (reply->flags & REPLY_STREAM)
+		frame.flags |= FRAME_STREAM;
+	frame.seq = reply->seq;
+	frame.status = reply->status;
+	frame.length = reply->length;
+
+	if (host_write_available(reply->port) < sizeof(frame) + reply->length)
+		return false;
+
+	host_write(reply->port, &frame, sizeof(frame));
+	host_write(reply->port, reply->data, reply->length);
+	return true;
+}
+
+// Time the reply at the head of the queue has been waiting for FIFO space
+static struct perf_wait stall;
+
+// Moves replies from core1 into the USB FIFOs
+static void host_tx_task()
+{
+	uint32_t written[PORT_COUNT] = {0};
+
+	struct reply *reply;
+	while ((reply = queue_peek(&engine_replies)))
+	{
+		if ((reply->flags & REPLY_STREAM) && reply->generation != stream_generation)
+		{
+			queue_release(&engine_replies);
+			continue;
+		}
+
+		if (!host_tx_reply(reply))
+		{
+			perf_wait_update(&stall, true);
+			break;
+		}
+
+		if (stall.waiting)
+		{
+			perf_wait_update(&stall, false);
+			perf_count(PERF_USB_STALL, stall.cycles);
+			stall.cycles = 0;
+		}
+
+		perf_count(PERF_USB_WRITE, reply->length);
+		written[reply->port] += reply->length;
+		queue_release(&engine_replies);
+	}
+
+	for (uint8_t port = 0; port < PORT_COUNT; ++port)
+		if (written[port])
+		{
+			host_flush(port);
+			trace(TRACE_USB_FLUSH, written[port], port);
+		}
+
+	stream_update_flash_wait(!reply);
+}
+
+void host_task()
+{
+	host_rx_task(PORT_CDC);
+	if (tud_vendor_mounted())
+		host_rx_task(PORT_VENDOR);
+
+	host_tx_task();
+}
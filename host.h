@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HOST_H__
+#define __HOST_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Commands are accepted on the CDC ACM interface and on the vendor bulk
+// interface; every reply goes back out of the port its command came in on.
+enum host_port
+{
+	PORT_CDC = 0,
+	PORT_VENDOR,
+	PORT_COUNT
+};
+
+uint32_t host_write_available(uint8_t port);
+void host_pages_cancel(uint8_t port); // core1, for a rejected write stream
+
+void host_task();
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "lz.h"
+
+#define LZ_HASH_BITS 8
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // the block must end in at least this many literals
+#define LZ_MF_LIMIT 12	   // and no match may start closer than this to the end
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_write_length(uint8_t *op, uint8_t *end, uint32_t length)
+{
+	while (length >= 255)
+	{
+		if (op >= end)
+			return NULL;
+		*op++ = 255;
+		length -= 255;
+	}
+
+	if (op >= end)
+		return NULL;
+	*op++ = length;
+	return op;
+}
+
+static uint8_t *lz_write_sequence(uint8_t *op, uint8_t *end, const uint8_t *literals, uint32_t literal_length, uint32_t offset, uint32_t match_length)
+{
+	if (op >= end)
+		return NULL;
+
+	uint8_t *token = op++;
+	*token = (literal_length < 15 ? literal_length : 15) << 4;
+	if (literal_length >= 15)
+	{
+		op = lz_write_length(op, end, literal_length - 15);
+		if (!op)
+			return NULL;
+	}
+
+	if (end - op < literal_length)
+		return NULL;
+	memcpy(op, literals, literal_length);
+	op += literal_length;
+
+	// The final sequence carries literals only
+	if (!match_length)
+		return op;
+
+	if (end - op < 2)
+		return NULL;
+	*op++ = offset;
+	*op++ = offset >> 8;
+
+	match_length -= LZ_MIN_MATCH;
+	*token |= match_length < 15 ? match_length : 15;
+	if (match_length >= 15)
+		op = lz_write_length(op, end, match_length - 15);
+
+	return op;
+}
+
+uint32_t lz_compress(const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t capacity)
+{
+	static uint16_t table[1 << LZ_HASH_BITS]; // position + 1, 0 is empty
+
+	uint8_t *op = dst;
+	uint8_t *end = dst + capacity;
+	uint32_t anchor = 0;
+	uint32_t ip = 0;
+
+	memset(table, 0, sizeof(table));
+
+	if (length > LZ_MF_LIMIT && length <= 0xFFFF)
+	{
+		uint32_t limit = length - LZ_MF_LIMIT;
+		uint32_t match_limit = length - LZ_LAST_LITERALS;
+
+		while (ip < limit)
+		{
+			uint32_t v = lz_read32(&src[ip]);
+			uint32_t h = lz_hash(v);
+			uint32_t ref = table[h];
+			table[h] = ip + 1;
+
+			if (!ref || lz_read32(&src[ref - 1]) != v)
+			{
+				++ip;
+				continue;
+			}
+			--ref;
+
+			uint32_t match_length = LZ_MIN_MATCH;
+			while (ip + match_length < match_limit && src[ref + match_length] == src[ip + match_length])
+				++match_length;
+
+			op = lz_write_sequence(op, end, &src[anchor], ip - anchor, ip - ref, match_length);
+			if (!op)
+				return 0;
+
+			ip += match_length;
+			anchor = ip;
+		}
+	}
+
+	op = lz_write_sequence(op, end, &src[anchor], length - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - dst;
+}
+
+int lz_decompress(const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t capacity)
+{
+	const uint8_t *ip = src;
+	const uint8_t *in_end = src + length;
+	uint8_t *op = dst;
+	uint8_t *out_end = dst + capacity;
+
+	while (ip < in_end)
+	{
+		uint8_t token = *ip++;
+
+		uint32_t literal_length = token >> 4;
+		if (literal_length == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if (ip >= in_end)
+					return -1;
+				b = *ip++;
+				literal_length += b;
+			} while (b == 255);
+		}
+
+		if (in_end - ip < literal_length || out_end - op < literal_length)
+			return -1;
+		memcpy(op, ip, literal_length);
+		ip += literal_length;
+		op += literal_length;
+
+		if (ip == in_end)
+			break;
+
+		if (in_end - ip < 2)
+			return -1;
+		uint32_t offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (!offset || offset > op - dst)
+			return -1;
+
+		uint32_t match_length = token & 15;
+		if (match_length == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if (ip >= in_end)
+					return -1;
+				b = *ip++;
+				match_length += b;
+			} while (b == 255);
+		}
+		match_length += LZ_MIN_MATCH;
+
+		if (out_end - op < match_length)
+			return -1;
+
+		// Byte wise, matches may overlap their own output
+		const uint8_t *ref = op - offset;
+		while (match_length--)
+			*op++ = *ref++;
+	}
+
+	return op - dst;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stdint.h>
+
+// Page sized compressor emitting the LZ4 block format, so host tools can
+// expand it with any LZ4 implementation. No state is kept between pages.
+
+// Returns the compressed length, or 0 if it would not fit into capacity
+uint32_t lz_compress(const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t capacity);
+
+// Returns the decompressed length, or -1 on malformed input
+int lz_decompress(const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t capacity);
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "tusb.h"
+#include "protocol.h"
+#include "engine.h"
+#include "stream.h"
+#include "xbox.h"
+#include "sdio.h"
+#include "msc.h"
+#include "host.h"
+
+// Set by core1, zero while the flash is not accessible
+static volatile uint32_t nand_pages = 0;
+static volatile uint32_t emmc_sectors = 0;
+
+// The one transfer in flight, TinyUSB repeats the callback until it is done
+static bool submitted = false;
+static volatile bool busy = false;
+static volatile int32_t result = 0;
+
+void msc_nand_attach(bool attach)
+{
+	nand_pages = attach ? xbox_nand_pages() : 0;
+}
+
+void msc_emmc_attach(uint32_t sectors)
+{
+	emmc_sectors = sectors;
+}
+
+static int32_t msc_emmc(uint32_t sector, const struct msc_request *request)
+{
+	uint8_t *buffer = request->buffer;
+	uint32_t count = request->length / SD_SECTOR_SIZE;
+
+	while (count)
+	{
+		uint32_t batch = count < SDIO_MAX_BLOCK_COUNT ? count : SDIO_MAX_BLOCK_COUNT;
+
+		int ret;
+		if (request->write)
+			ret = sd_writeblocks_sync(buffer, sector, batch);
+		else
+			ret = sd_readblocks_sync(buffer, sector, batch);
+		if (ret)
+			return -1;
+
+		buffer += batch * SD_SECTOR_SIZE;
+		sector += batch;
+		count -= batch;
+	}
+
+	return request->length;
+}
+
+// Pages straddle the 512 byte blocks, the one split at the end of a transfer
+// is read again by the next
+static int32_t msc_nand_raw(uint64_t position, const struct msc_request *request)
+{
+	static uint8_t page[0x210] __attribute__((aligned(4)));
+	uint32_t cached = UINT32_MAX;
+
+	uint8_t *buffer = request->buffer;
+	uint32_t left = request->length;
+	while (left)
+	{
+		uint32_t lba = position / 0x210;
+		uint32_t in_page = position % 0x210;
+		uint32_t chunk = 0x210 - in_page < left ? 0x210 - in_page : left;
+
+		if (lba != cached)
+		{
+			if (xbox_nand_read_block(lba, page, &page[0x200]))
+				return -1;
+			cached = lba;
+		}
+
+		memcpy(buffer, &page[in_page], chunk);
+		buffer += chunk;
+		position += chunk;
+		left -= chunk;
+	}
+
+	return request->length;
+}
+
+static int32_t msc_nand_data(uint32_t lba, const struct msc_request *request)
+{
+	uint8_t spare[0x10] __attribute__((aligned(4)));
+
+	for (uint32_t i = 0; i < request->length / 0x200; ++i)
+		if (xbox_nand_read_block(lba + i, &request->buffer[i * 0x200], spare))
+			return -1;
+
+	return request->length;
+}
+
+void msc_execute(uint32_t lba, const struct msc_request *request)
+{
+	int32_t ret = -1;
+
+	if (request->lun == LUN_EMMC)
+		ret = emmc_sectors ? msc_emmc(lba + request->offset / SD_SECTOR_SIZE, request) : -1;
+	else if (!nand_pages || request->write)
+		ret = -1;
+	else if (request->lun == LUN_NAND_RAW)
+		ret = msc_nand_raw((uint64_t)lba * 0x200 + request->offset, request);
+	else if (request->lun == LUN_NAND_DATA)
+		ret = msc_nand_data(lba + request->offset / 0x200, request);
+
+	result = ret;
+	__dmb();
+	busy = false;
+}
+
+static int32_t msc_transfer(uint8_t lun, bool write, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize)
+{
+	if (submitted)
+	{
+		if (busy)
+			return 0;
+
+		submitted = false;
+		__dmb();
+		if (result < 0)
+			tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, write ? 0x0C : 0x11, 0x00);
+		return result;
+	}
+
+	struct job *job = queue_acquire(&engine_jobs);
+	if (!job)
+		return 0;
+
+	struct msc_request request;
+	request.lun = lun;
+	request.write = write;
+	request.offset = offset;
+	request.length = bufsize;
+	request.buffer = buffer;
+
+	job->cmd = MSC_TRANSFER;
+	job->port = PORT_CDC;
+	job->framed = false;
+	job->seq = 0;
+	job->lba = lba;
+	job->generation = stream_generation;
+	job->length = sizeof(request);
+	memcpy(job->payload, &request, sizeof(request));
+
+	busy = true;
+	submitted = true;
+	queue_commit(&engine_jobs);
+	return 0;
+}
+
+uint8_t tud_msc_get_maxlun_cb(void)
+{
+	return LUN_COUNT;
+}
+
+void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
+{
+	static const char *products[LUN_COUNT] = {"eMMC", "NAND raw", "NAND data"};
+
+	memcpy(vendor_id, "PicoFlsh", 8);
+	memset(product_id, ' ', 16);
+	memcpy(product_id, products[lun], strlen(products[lun]));
+	memcpy(product_rev, "4   ", 4);
+}
+
+bool tud_msc_test_unit_ready_cb(uint8_t lun)
+{
+	bool ready = lun == LUN_EMMC ? emmc_sectors : nand_pages;
+	if (!ready)
+		tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3A, 0x00); // medium not present
+
+	return ready;
+}
+
+void tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size)
+{
+	*block_size = 512;
+
+	if (lun == LUN_EMMC)
+		*block_count = emmc_sectors;
+	else if (lun == LUN_NAND_RAW)
+		*block_count = (uint64_t)nand_pages * 0x210 / 512;
+	else
+		*block_count = nand_pages;
+}
+
+bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject)
+{
+	(void)lun;
+	(void)power_condition;
+	(void)start;
+	(void)load_eject;
+
+	return true;
+}
+
+bool tud_msc_is_writable_cb(uint8_t lun)
+{
+	return lun == LUN_EMMC;
+}
+
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize)
+{
+	return msc_transfer(lun, false, lba, offset, buffer, bufsize);
+}
+
+// NAND needs whole block erases, the NAND views stay read only
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize)
+{
+	if (lun != LUN_EMMC)
+	{
+		tud_msc_set_sense(lun, SCSI_SENSE_DATA_PROTECT, 0x27, 0x00); // write protected
+		return -1;
+	}
+
+	return msc_transfer(lun, true, lba, offset, buffer, bufsize);
+}
+
+int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, uint16_t bufsize)
+{
+	(void)buffer;
+	(void)bufsize;
+
+	switch (scsi_cmd[0])
+	{
+	case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+		return 0;
+	}
+
+	tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00); // invalid command
+	return -1;
+}
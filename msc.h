@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MSC_H__
+#define __MSC_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Mass storage view of the flashes. The TinyUSB callbacks run on core0 and
+// hand every transfer to core1 as a job; the callback keeps reporting busy
+// until core1 has filled or drained the TinyUSB buffer.
+enum msc_lun
+{
+	LUN_EMMC = 0,
+	LUN_NAND_RAW,  // 0x210 byte pages back to back, as in a J-Runner dump
+	LUN_NAND_DATA, // 0x200 byte pages, spare stripped
+	LUN_COUNT
+};
+
+struct msc_request
+{
+	uint8_t lun;
+	bool write;
+	uint32_t offset;
+	uint32_t length;
+	uint8_t *buffer;
+};
+
+// core1
+void msc_nand_attach(bool attach);
+void msc_emmc_attach(uint32_t sectors);
+void msc_execute(uint32_t lba, const struct msc_request *request);
+
+#endif
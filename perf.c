@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "perf.h"
+
+struct perf_counter perf_counters[PERF_COUNT] =
+{
+	[0 ... PERF_COUNT - 1] = {0, UINT32_MAX, 0, 0}
+};
+
+void perf_counters_reset()
+{
+	for (uint32_t i = 0; i < PERF_COUNT; ++i)
+	{
+		perf_counters[i].count = 0;
+		perf_counters[i].min = UINT32_MAX;
+		perf_counters[i].max = 0;
+		perf_counters[i].total = 0;
+	}
+}
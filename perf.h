@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hardware/structs/systick.h"
+
+// SysTick is a per-core 24-bit down counter clocked from clk_sys, so every
+// core that measures anything has to call perf_init() once. Intervals must
+// stay below 2^24 cycles (~63ms at 266MHz).
+
+#define PERF_CYCLES_MASK 0x00FFFFFF
+
+static inline void perf_init()
+{
+	systick_hw->rvr = PERF_CYCLES_MASK;
+	systick_hw->cvr = 0;
+	systick_hw->csr = 0x5; // ENABLE | CLKSOURCE (processor clock)
+}
+
+static inline uint32_t perf_cycles()
+{
+	return systick_hw->cvr;
+}
+
+static inline uint32_t perf_elapsed(uint32_t start)
+{
+	return (start - systick_hw->cvr) & PERF_CYCLES_MASK;
+}
+
+// Accumulates the time spent in a waiting state. Call perf_wait_update()
+// on every loop pass with whether the caller is currently blocked.
+struct perf_wait
+{
+	uint64_t cycles;
+	uint32_t last;
+	bool waiting;
+};
+
+static inline void perf_wait_reset(struct perf_wait *wait)
+{
+	wait->cycles = 0;
+	wait->last = perf_cycles();
+	wait->waiting = false;
+}
+
+static inline void perf_wait_update(struct perf_wait *wait, bool waiting)
+{
+	uint32_t now = perf_cycles();
+	if (wait->waiting)
+		wait->cycles += (wait->last - now) & PERF_CYCLES_MASK;
+	wait->last = now;
+	wait->waiting = waiting;
+}
+
+// Event counters, cheap enough to stay in production builds. Each counter is
+// only updated by one core, GET_STATS reads them from core1 without locking.
+enum perf_id
+{
+	PERF_SPI_READ,	 // cycles per register read, bursts included
+	PERF_SPI_WRITE,	 // cycles per register write, bursts included
+	PERF_NAND_WAIT,	 // status polls per xbox_nand_wait_ready
+	PERF_SD_COMMAND, // cycles per sd_command
+	PERF_DMA_WAIT,	 // spins per safe_dma_wait_for_finish
+	PERF_USB_WRITE,	 // bytes per reply moved into a USB FIFO (core0)
+	PERF_USB_STALL,	 // cycles a reply waited for FIFO space (core0)
+	PERF_SPI_BURST,	 // cycles per spiex_read_burst
+	PERF_NAND_EDC,	 // cycles per xbox_nand_check_edc
+	PERF_COUNT
+};
+
+struct perf_counter
+{
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+};
+
+extern struct perf_counter perf_counters[PERF_COUNT];
+
+static inline void perf_count(enum perf_id id, uint32_t value)
+{
+	struct perf_counter *counter = &perf_counters[id];
+	counter->count++;
+	counter->total += value;
+	if (value < counter->min)
+		counter->min = value;
+	if (value > counter->max)
+		counter->max = value;
+}
+
+// count events of value cycles each, for transfers timed as a whole
+static inline void perf_count_many(enum perf_id id, uint32_t count, uint32_t value)
+{
+	struct perf_counter *counter = &perf_counters[id];
+	if (!count)
+		return;
+	counter->count += count;
+	counter->total += (uint64_t)count * value;
+	if (value < counter->min)
+		counter->min = value;
+	if (value > counter->max)
+		counter->max = value;
+}
+
+void perf_counters_reset();
+
+#endif
@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define GET_VERSION 0x00
+#define GET_FLASH_CONFIG 0x01
+#define READ_FLASH 0x02
+#define WRITE_FLASH 0x03
+#define READ_FLASH_STREAM 0x04
+#define READ_FLASH_STREAM_RANGE 0x05
+#define GET_STREAM_STATS 0x06
+#define WRITE_FLASH_BLOCK 0x07
+#define WRITE_FLASH_STREAM 0x08
+#define SET_STREAM_FLAGS 0x09
+#define FLASH_CHECKSUM 0x0A
+#define FLASH_DIFF 0x0B
+#define GET_CAPS 0x0C
+#define GET_STATS 0x0D
+#define TRACE_DUMP 0x0E
+#define SMC_CALIBRATE 0x0F
+#define READ_FLASH_SPARE_STREAM 0x10
+#define NAND_BAD_BLOCK_SCAN 0x11
+#define WRITE_FLASH_BLOCK_DATA 0x12
+
+#define EMMC_DETECT 0x50
+#define EMMC_INIT 0x51
+#define EMMC_GET_CID 0x52
+#define EMMC_GET_CSD 0x53
+#define EMMC_GET_EXT_CSD 0x54
+#define EMMC_READ 0x55
+#define EMMC_READ_STREAM 0x56
+#define EMMC_WRITE 0x57
+#define EMMC_READ_STREAM_RANGE 0x58
+#define EMMC_WRITE_STREAM 0x59
+#define EMMC_CHECKSUM 0x5A
+
+#define ISD1200_INIT 0xA0
+#define ISD1200_DEINIT 0xA1
+#define ISD1200_READ_ID 0xA2
+#define ISD1200_READ_FLASH 0xA3
+#define ISD1200_ERASE_FLASH 0xA4
+#define ISD1200_WRITE_FLASH 0xA5
+#define ISD1200_PLAY_VOICE 0xA6
+#define ISD1200_EXEC_MACRO 0xA7
+#define ISD1200_RESET 0xA8
+
+// Only queued internally, never sent by the host. The host side drops them,
+// see cmd_internal(). 0xF0 and 0xF1 are reserved, they were SMC start/stop.
+#define WRITE_FLASH_BLOCK_PAGE 0xF2
+#define WRITE_FLASH_STREAM_PAGE 0xF3
+#define EMMC_WRITE_STREAM_PAGE 0xF4
+#define FRAME_REJECT 0xF5 // lba holds the frame status
+#define MSC_TRANSFER 0xF6 // payload is a struct msc_request
+#define WRITE_FLASH_BLOCK_DATA_PAGE 0xF7
+
+#define REBOOT_TO_BOOTLOADER 0xFE
+
+// WRITE_FLASH_BLOCK: lba is the first page of an erase block, the payload
+// the number of pages that follow as 0x210 byte page + spare records. The
+// single reply is a u32 status and one bit per page, set if it failed.
+// A count other than the pages of one erase block fails the block with
+// WRITE_FLASH_BLOCK_BAD_GEOMETRY, its pages are still taken. A count above
+// WRITE_FLASH_BLOCK_MAX_PAGES fails at once, with no bitmap, and only
+// WRITE_FLASH_BLOCK_MAX_PAGES pages of it are skipped.
+#define WRITE_FLASH_BLOCK_MAX_PAGES (0x40000 / 0x200)
+#define WRITE_FLASH_BLOCK_BAD_GEOMETRY 0x10000 // not one whole erase block
+
+// WRITE_FLASH_BLOCK_DATA: as WRITE_FLASH_BLOCK, but the payload is a struct
+// write_block_data_args and only the 0x200 data bytes of every page follow.
+// The device lays out the spare for the part's meta type (small block,
+// big on small or big block, as in libxenon) from the block's metadata,
+// with a good bad block marker, and adds the EDC.
+struct nand_block_meta
+{
+	uint16_t id;	 // logical block number, 12 bits
+	uint8_t fs_type; // 6 bits
+	uint8_t fs_page_count;
+	uint32_t fs_sequence;
+	uint16_t fs_size;
+	uint16_t reserved;
+};
+
+struct write_block_data_args
+{
+	uint32_t count; // pages that follow
+	struct nand_block_meta meta;
+};
+
+// WRITE_FLASH_STREAM / EMMC_WRITE_STREAM: lba is the first page, the payload
+// the number of pages that follow (0x210 bytes for NAND, 0x200 for eMMC).
+// The device first replies with a u32 credit, the number of pages the host
+// may have sent but not seen acknowledged. Every page is then acknowledged
+// with a struct write_ack, a non-zero status carries the failing lba. The
+// stream keeps going after an error, the host decides whether to stop. A
+// stream running past the end of the flash is rejected before any page:
+// with FRAME_BAD_COUNT when framed, otherwise with a credit of 0.
+#define WRITE_STREAM_CREDIT 16
+
+// SET_STREAM_FLAGS: lba holds the flags for the following read streams, the
+// reply is the u32 subset the device supports.
+#define STREAM_FLAG_COMPRESS 0x01
+#define STREAM_FLAG_EDC 0x02
+
+// With STREAM_FLAG_EDC the NAND read streams check the EDC in the spare of
+// every page. A page that does not match is still sent and the stream goes
+// on, its status is STREAM_EDC_MISMATCH instead of 0, or with
+// STREAM_FLAG_COMPRESS it comes as an EDC record holding the raw page.
+#define STREAM_EDC_MISMATCH 0x10000
+
+// With STREAM_FLAG_CONTINUE a page that cannot be read no longer ends the
+// NAND, eMMC and spare streams. It is sent as its u32 status alone, or as an
+// ERROR record for its lba when compressed (see READ_FLASH_SPARE_STREAM for
+// the spare map), and the stream goes on with the next page. Failed reads are first retried as often as the flags' retry
+// field says, with or without STREAM_FLAG_CONTINUE.
+#define STREAM_FLAG_CONTINUE 0x04
+#define STREAM_RETRIES_SHIFT 8
+#define STREAM_RETRIES_MASK 0xF00
+
+// With STREAM_FLAG_COMPRESS the read streams send a sequence of records
+// instead of status + page. Runs of pages made of a single byte value
+// (erased NAND, zeroed eMMC) collapse into one FILL record, other pages are
+// sent as an LZ4 block if that is smaller than the page, RAW otherwise.
+// An ERROR record carries the u32 status and ends the stream, unless
+// STREAM_FLAG_CONTINUE is set.
+#define STREAM_RECORD_RAW 0
+#define STREAM_RECORD_FILL 1
+#define STREAM_RECORD_LZ 2
+#define STREAM_RECORD_ERROR 3
+#define STREAM_RECORD_EDC 4 // RAW, but the EDC does not match
+
+// READ_FLASH_SPARE_STREAM: lba is the first page, the payload the u32 page
+// count. Only the 0x10 byte spare area of each page crosses the SPI bus.
+// Every reply is a u32 status followed by the spares of up to
+// SPARE_MAP_PAGES consecutive pages; a non-zero status ends the stream, its
+// spares stop before the page that failed. With STREAM_FLAG_CONTINUE the
+// stream goes on instead, at the page after the failed one. The retries of
+// the stream flags apply, STREAM_FLAG_COMPRESS and STREAM_FLAG_EDC do not.
+#define SPARE_MAP_PAGES 32
+
+// NAND_BAD_BLOCK_SCAN: walks every erase block of the NAND, reading the
+// spare of its first two pages. The reply is a struct bad_block_scan, a
+// bitmap with one bit per block, set if it is bad, and one BAD_BLOCK_* byte
+// per block. The bad block marker is spare byte 5 on small block parts and
+// byte 0 on big block ones, as in libxenon. Should the controller refuse a
+// block's address (ADDR_ER), the part ends there and blocks stops short.
+#define BAD_BLOCK_MARKER 0x01	  // marker byte is not 0xFF
+#define BAD_BLOCK_CONTROLLER 0x02 // the SMC flagged the read with BB_ER
+#define BAD_BLOCK_READ_FAILED 0x04 // timed out or RNP_ER
+#define BAD_BLOCK_ECC 0x08		  // corrected ECC error, not counted as bad
+#define BAD_BLOCK_BAD (BAD_BLOCK_MARKER | BAD_BLOCK_CONTROLLER | BAD_BLOCK_READ_FAILED)
+
+struct bad_block_scan
+{
+	uint32_t blocks;
+	uint32_t pages_per_block;
+	uint32_t bad; // blocks set in the bitmap
+};
+
+// FLASH_CHECKSUM / EMMC_CHECKSUM: lba is the first page, the payload a u32
+// page count and a u32 chunk size in pages (0 for the whole range). Every
+// chunk is answered with a CRC-32 of its pages (data + spare for NAND), the
+// last one may be short. A read error ends the reply with a digest carrying
+// the status.
+struct checksum_args
+{
+	uint32_t count;
+	uint32_t chunk;
+};
+
+// FLASH_DIFF: lba is the first page of an erase block, the payload the
+// CRC-32 the host expects for each of the following blocks, as FLASH_CHECKSUM
+// with a chunk of one block would report it. The reply is a u32 status and
+// one bit per block, set if the block differs and has to be rewritten.
+#define FLASH_DIFF_MAX_BLOCKS 128 // keeps the list within a 0x210 byte job payload
+#define FLASH_DIFF_BAD_ARGS 0x10000 // not block aligned or too many blocks
+
+struct flash_diff_args
+{
+	uint32_t count;
+	uint32_t crc[FLASH_DIFF_MAX_BLOCKS];
+};
+
+#pragma pack(push, 1)
+struct checksum_digest
+{
+	uint32_t status;
+	uint32_t crc;
+};
+
+struct write_ack
+{
+	uint32_t lba;
+	uint32_t status;
+};
+
+struct stream_record
+{
+	uint32_t lba;	 // first page
+	uint16_t count;	 // pages covered
+	uint16_t length; // bytes following the record
+	uint8_t type;
+	uint8_t value; // fill byte
+	uint16_t reserved;
+};
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct cmd
+{
+	uint8_t cmd;
+	uint32_t lba;
+};
+#pragma pack(pop)
+
+// Framed commands start with FRAME_MAGIC, which is not a command, and may be
+// mixed freely with plain ones. The payload has to be the command's usual
+// one. Every reply to a framed command comes in frames carrying its seq, the
+// last one flagged FRAME_END; a stream ends with an empty FRAME_END frame
+// unless a newer stream replaced it. Pages following a framed
+// WRITE_FLASH_BLOCK or write stream header are sent bare, as without framing.
+#define FRAME_MAGIC 0xFA
+#define FRAME_REPLY_MAGIC 0xFB
+#define FRAME_VERSION 1
+
+// frame_reply.flags
+#define FRAME_END 0x01
+#define FRAME_STREAM 0x02
+
+// frame_reply.status
+#define FRAME_OK 0
+#define FRAME_BAD_VERSION 1
+#define FRAME_BAD_LENGTH 2 // the length does not match the command
+#define FRAME_UNSUPPORTED 3
+#define FRAME_BAD_COUNT 4 // write stream past the end of the flash
+
+#pragma pack(push, 1)
+struct frame
+{
+	uint8_t magic;
+	uint8_t version;
+	uint16_t seq;
+	uint8_t cmd;
+	uint8_t reserved[3];
+	uint32_t lba;
+	uint32_t length; // payload bytes following
+};
+
+struct frame_reply
+{
+	uint8_t magic;
+	uint8_t flags;
+	uint16_t seq;
+	uint16_t status;
+	uint16_t length; // reply bytes following
+};
+#pragma pack(pop)
+
+// GET_STATS: a u32 count followed by that many struct perf_stat, in the
+// order of enum perf_id. Bit 0 of lba resets the counters after reading.
+#define GET_STATS_RESET 0x01
+
+#pragma pack(push, 1)
+struct perf_stat
+{
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+};
+#pragma pack(pop)
+
+// TRACE_DUMP: for each core a struct trace_header followed by its count
+// struct trace_event (see trace.h), oldest first. Bit 0 of lba clears the
+// rings after reading.
+#define TRACE_DUMP_CLEAR 0x01
+
+struct trace_header
+{
+	uint32_t core;
+	uint32_t count;
+	uint32_t dropped; // overwritten before this dump
+};
+
+// SMC_CALIBRATE: lba is a NAND page to read back. Every combination of
+// spiex clock divider and MISO sample point reads the flash config register
+// and that page a number of times, compared bit by bit against a read at the
+// slowest setting. The fastest error free setting whose next faster divider
+// is also error free at the same sample point is kept until the device
+// resets. The reply is a struct smc_calibration followed by count struct
+// smc_calibration_point, fastest first.
+#define SMC_SAMPLE_EARLY 0 // through the input synchronizer, two clk_sys earlier
+#define SMC_SAMPLE_EDGE 1  // on the rising SCK edge
+#define SMC_SAMPLE_LATE 2  // one PIO cycle after the rising edge
+#define SMC_SAMPLE_COUNT 3
+
+#define SMC_CALIBRATE_NO_MARGIN 0x10000	  // kept the slowest clean setting
+#define SMC_CALIBRATE_FAILED 0x10001	  // nothing was clean, timing unchanged
+#define SMC_CALIBRATE_NOT_RUNNING 0x10002 // SMC not stopped for flashing
+
+#pragma pack(push, 1)
+struct smc_calibration_point
+{
+	uint16_t clkdiv; // PIO clock divider in half steps
+	uint8_t sample;	 // SMC_SAMPLE_*
+	uint8_t reserved;
+	uint32_t baudrate; // SCK in Hz
+	uint32_t bits;	   // compared
+	uint32_t errors;   // bits that differed
+};
+
+struct smc_calibration
+{
+	uint32_t status; // 0 or a NAND status if the reference read failed
+	uint32_t count;
+	struct smc_calibration_point selected;
+};
+#pragma pack(pop)
+
+// GET_CAPS reply
+#define CAPS_VERSION 1
+
+struct caps
+{
+	uint32_t version; // of this struct
+	uint32_t firmware_version;
+	uint32_t frame_version;
+	uint32_t max_payload;	   // largest command payload
+	uint32_t max_reply;		   // largest frame_reply.length
+	uint32_t jobs_in_flight;   // commands queued before USB stalls
+	uint32_t write_credit;	   // WRITE_STREAM_CREDIT
+	uint32_t emmc_batch;	   // sectors per eMMC transfer
+	uint32_t diff_blocks;	   // FLASH_DIFF_MAX_BLOCKS
+	uint32_t stream_flags;	   // supported STREAM_FLAG_*
+	uint8_t commands[256 / 8]; // bit per supported opcode
+};
+
+// Bytes following struct cmd for each command
+static inline uint32_t cmd_payload_length(uint8_t cmd)
+{
+	switch (cmd)
+	{
+	case WRITE_FLASH:
+	case WRITE_FLASH_BLOCK_PAGE:
+	case WRITE_FLASH_STREAM_PAGE:
+		return 0x210;
+	case WRITE_FLASH_BLOCK_DATA_PAGE:
+		return 0x200;
+	case WRITE_FLASH_BLOCK_DATA:
+		return sizeof(struct write_block_data_args);
+	case READ_FLASH_STREAM_RANGE:
+	case READ_FLASH_SPARE_STREAM:
+	case WRITE_FLASH_BLOCK:
+	case WRITE_FLASH_STREAM:
+	case EMMC_READ_STREAM_RANGE:
+	case EMMC_WRITE_STREAM:
+		return 4;
+	case FLASH_CHECKSUM:
+	case EMMC_CHECKSUM:
+		return sizeof(struct checksum_args);
+	case FLASH_DIFF:
+		return sizeof(struct flash_diff_args);
+	case EMMC_WRITE:
+	case EMMC_WRITE_STREAM_PAGE:
+		return 0x200;
+	case ISD1200_WRITE_FLASH:
+		return 16;
+	}
+	return 0;
+}
+
+// Commands whose header is followed by a counted run of pages, each handed
+// to the engine as a job of its own
+static inline uint8_t cmd_page_command(uint8_t cmd)
+{
+	switch (cmd)
+	{
+	case WRITE_FLASH_BLOCK:
+		return WRITE_FLASH_BLOCK_PAGE;
+	case WRITE_FLASH_BLOCK_DATA:
+		return WRITE_FLASH_BLOCK_DATA_PAGE;
+	case WRITE_FLASH_STREAM:
+		return WRITE_FLASH_STREAM_PAGE;
+	case EMMC_WRITE_STREAM:
+		return EMMC_WRITE_STREAM_PAGE;
+	}
+	return 0;
+}
+
+static inline bool cmd_is_block_page(uint8_t cmd)
+{
+	return cmd == WRITE_FLASH_BLOCK_PAGE || cmd == WRITE_FLASH_BLOCK_DATA_PAGE;
+}
+
+static inline bool cmd_is_page(uint8_t cmd)
+{
+	return cmd == WRITE_FLASH_BLOCK_PAGE || cmd == WRITE_FLASH_BLOCK_DATA_PAGE || cmd == WRITE_FLASH_STREAM_PAGE ||
+		   cmd == EMMC_WRITE_STREAM_PAGE;
+}
+
+// Opcodes from 0xF0 up are not accepted from the host, except
+// REBOOT_TO_BOOTLOADER
+static inline bool cmd_internal(uint8_t cmd)
+{
+	return cmd >= 0xF0 && cmd != REBOOT_TO_BOOTLOADER;
+}
+
+static inline bool cmd_starts_stream(uint8_t cmd)
+{
+	return cmd == READ_FLASH_STREAM || cmd == READ_FLASH_STREAM_RANGE || cmd == READ_FLASH_SPARE_STREAM ||
+		   cmd == EMMC_READ_STREAM || cmd == EMMC_READ_STREAM_RANGE;
+}
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hardware/sync.h"
+
+// Lock-free single producer / single consumer ring of fixed size slots, used
+// to pass work between the cores. head is only written by the producer and
+// tail only by the consumer; slot contents are published by the barrier in
+// queue_commit() and handed back by the one in queue_release(). The slot
+// count must be a power of two so the free running indices wrap cleanly.
+struct queue
+{
+	uint8_t *slots;
+	uint32_t slot_size;
+	uint32_t count;
+	volatile uint32_t head;
+	volatile uint32_t tail;
+};
+
+#define QUEUE_INIT(storage) {(uint8_t *)(storage), sizeof((storage)[0]), sizeof(storage) / sizeof((storage)[0]), 0, 0}
+
+static inline void *queue_slot(struct queue *queue, uint32_t index)
+{
+	return queue->slots + (index % queue->count) * queue->slot_size;
+}
+
+static inline uint32_t queue_used(struct queue *queue)
+{
+	return queue->head - queue->tail;
+}
+
+static inline uint32_t queue_free(struct queue *queue)
+{
+	return queue->count - queue_used(queue);
+}
+
+// Free slots at the head that are contiguous in memory
+static inline uint32_t queue_free_contiguous(struct queue *queue)
+{
+	uint32_t free = queue_free(queue);
+	uint32_t to_end = queue->count - queue->head % queue->count;
+	return free < to_end ? free : to_end;
+}
+
+// Producer side
+static inline void *queue_acquire(struct queue *queue)
+{
+	if (!queue_free(queue))
+		return NULL;
+	return queue_slot(queue, queue->head);
+}
+
+static inline void queue_commit_n(struct queue *queue, uint32_t count)
+{
+	__dmb();
+	queue->head += count;
+}
+
+static inline void queue_commit(struct queue *queue)
+{
+	queue_commit_n(queue, 1);
+}
+
+// Consumer side
+static inline void *queue_peek(struct queue *queue)
+{
+	if (queue->head == queue->tail)
+		return NULL;
+	__dmb();
+	return queue_slot(queue, queue->tail);
+}
+
+static inline void queue_release(struct queue *queue)
+{
+	__dmb();
+	queue->tail++;
+}
+
+#endif
@@ -24,6 +24,8 @@
 #include "sdio.pio.h"
 #include "crc7.h"
 #include "crc-itu-t.h"
+#include "perf.h"
+#include "trace.h"
 #include "pico/binary_info.h"
 #include "pins.h"
 #include "mmc_defs.h"
@@ -59,6 +61,10 @@ uint8_t csd_raw[16];
 static uint32_t crcs[SDIO_MAX_BLOCK_COUNT * 2];
 static uint32_t ctrl_words[(SDIO_MAX_BLOCK_COUNT + 1) * 4];
 static uint32_t pio_cmd_buf[SDIO_MAX_BLOCK_COUNT * 3];
+
+// read in flight, its CRCs are checked once it lands
+static const uint32_t *read_ctrl;
+static int read_result = SD_OK;
 uint32_t zeroes;
 uint32_t start_bit = 0xfffffffe;
 
@@ -70,6 +76,7 @@ inline static int safe_wait_tx_empty(pio_hw_t *pio, uint sm)
 		wooble++;
 		if (wooble > 1000000)
 		{
+			trace(TRACE_PIO_STUCK, pio->sm[sm].addr, sm);
 			printf("stuck %d @ %d\n", sm, (int)pio->sm[sm].addr);
 			__breakpoint();
 			return SD_ERR_STUCK;
@@ -86,6 +93,7 @@ inline static int safe_wait_tx_not_full(pio_hw_t *pio, uint sm)
 		wooble++;
 		if (wooble > 1000000)
 		{
+			trace(TRACE_PIO_STUCK, pio->sm[sm].addr, sm);
 			printf("stuck %d @ %d\n", sm, (int)pio->sm[sm].addr);
 			__breakpoint();
 			return SD_ERR_STUCK;
@@ -107,6 +115,7 @@ inline static int safe_dma_wait_for_finish(pio_hw_t *pio, uint sm, uint chan)
 			return SD_ERR_STUCK;
 		}
 	}
+	perf_count(PERF_DMA_WAIT, wooble);
 	return SD_OK;
 }
 
@@ -299,7 +308,7 @@ int __time_critical_func(sd_response_dma)(uint dma_channel, uint sm, uint8_t *bu
 	return rc;
 }
 
-int __noinline sd_command(uint8_t cmd, uint32_t arg, void *response)
+static int sd_command_unmetered(uint8_t cmd, uint32_t arg, void *response)
 {
 	int rc = acquiesce_sm(SD_CMD_SM);
 	if (rc)
@@ -417,6 +426,14 @@ int __noinline sd_command(uint8_t cmd, uint32_t arg, void *response)
 	return SD_OK;
 }
 
+int __noinline sd_command(uint8_t cmd, uint32_t arg, void *response)
+{
+	uint32_t start = perf_cycles();
+	int rc = sd_command_unmetered(cmd, arg, response);
+	perf_count(PERF_SD_COMMAND, perf_elapsed(start));
+	return rc;
+}
+
 int sd_wait()
 {
 	int rc = acquiesce_sm(SD_DAT_SM);
@@ -646,6 +663,44 @@ static uint32_t *start_read_to_buf(int sm, uint32_t *buf, uint byte_length, bool
 	return buf;
 }
 
+// A read that failed to start leaves the chain armed and the DAT SM waiting
+// for data that never comes
+static void sd_read_abort()
+{
+	dma_channel_abort(sd_chain_dma_channel);
+	dma_channel_abort(sd_data_dma_channel);
+	dma_channel_abort(sd_pio_dma_channel);
+
+	pio_sm_set_enabled(sd_pio, SD_DAT_SM, false);
+	pio_sm_clear_fifos(sd_pio, SD_DAT_SM);
+	pio_sm_restart(sd_pio, SD_DAT_SM);
+	pio_sm_exec(sd_pio, SD_DAT_SM, pio_encode_jmp(sd_cmd_or_dat_offset_no_arg_state_waiting_for_cmd));
+	pio_sm_set_enabled(sd_pio, SD_DAT_SM, true);
+
+	read_ctrl = NULL;
+}
+
+static uint16_t sd_crc16(const uint8_t *data, uint length)
+{
+	uint16_t crc = 0;
+	while (length--)
+		crc = (crc << 8) ^ crc_itu_t_table[((crc >> 8) ^ *data++) & 0xFF];
+	return crc;
+}
+
+// control words come in data, CRC pairs; the CRC lands big endian in the
+// first two bytes of its word
+static int sd_check_crcs(const uint32_t *p)
+{
+	for (; p[0]; p += 4)
+	{
+		const uint8_t *crc = (const uint8_t *)(uintptr_t)p[2];
+		if (sd_crc16((const uint8_t *)(uintptr_t)p[0], p[1] * 4) != ((crc[0] << 8) | crc[1]))
+			return SD_ERR_CRC;
+	}
+	return SD_OK;
+}
+
 // note caller must make space for CRC (2 word) in 4 bit mode
 int sd_readblocks_scatter_async(uint32_t *control_words, uint32_t block, uint block_count)
 {
@@ -661,10 +716,15 @@ int sd_readblocks_scatter_async(uint32_t *control_words, uint32_t block, uint bl
 	}
 
 	// todo further state checks
+	uint32_t spins = 0;
+	uint32_t pc = sd_pio->sm[SD_DAT_SM].addr;
 	while (sd_pio->sm[SD_DAT_SM].addr != sd_cmd_or_dat_offset_no_arg_state_waiting_for_cmd)
-	{
-		printf("oops %d\n", (uint)sd_pio->sm[SD_DAT_SM].addr);
-	}
+		++spins;
+	if (spins)
+		trace(TRACE_PIO_WAIT, pc, spins < 0xFFFF ? spins : 0xFFFF);
+
+	trace(TRACE_DMA_START, block, block_count);
+
 	assert(sd_pio->sm[SD_DAT_SM].addr == sd_cmd_or_dat_offset_no_arg_state_waiting_for_cmd);
 	assert(pio_sm_is_rx_fifo_empty(sd_pio, SD_DAT_SM));
 	assert(block_count <= SDIO_MAX_BLOCK_COUNT);
@@ -710,6 +770,10 @@ int sd_readblocks_scatter_async(uint32_t *control_words, uint32_t block, uint bl
 				rc = response & R1_OUT_OF_RANGE;
 		}
 	}
+	if (rc)
+		sd_read_abort();
+	else
+		read_ctrl = control_words;
 	return rc;
 }
 
@@ -729,20 +793,32 @@ bool sd_scatter_read_complete(int *status)
 		rc = (sd_pio->sm[SD_DAT_SM].addr == sd_cmd_or_dat_offset_no_arg_state_waiting_for_cmd &&
 			  pio_sm_is_tx_fifo_empty(sd_pio, SD_DAT_SM));
 	}
+	if (rc && read_ctrl)
+	{
+		read_result = sd_check_crcs(read_ctrl);
+		read_ctrl = NULL;
+	}
 	if (status)
-		*status = SD_OK;
+		*status = read_result;
 	return rc;
 }
 
 int sd_readblocks_async(void *buf, uint32_t block, uint block_count)
+{
+	return sd_readblocks_strided_async(buf, 512, block, block_count);
+}
+
+// like sd_readblocks_async, but block i lands at buf + i * stride
+int sd_readblocks_strided_async(void *buf, uint stride, uint32_t block, uint block_count)
 {
 	assert(block_count <= SDIO_MAX_BLOCK_COUNT);
+	assert(!(3u & stride));
 
 	uint32_t *p = ctrl_words;
 	uint crc_words = 1;
 	for (int i = 0; i < block_count; i++)
 	{
-		*p++ = (uintptr_t)((uint8_t *)buf + i * 512);
+		*p++ = (uintptr_t)((uint8_t *)buf + i * stride);
 		*p++ = 128;
 		// for now we read the CRCs also
 		*p++ = (uintptr_t)(crcs + i * crc_words);
@@ -865,10 +941,15 @@ int sd_writeblocks_async(const void *data, uint32_t sector_num, uint sector_coun
 	*p++ = 0;
 
 	// todo further state checks
+	uint32_t spins = 0;
+	uint32_t pc = sd_pio->sm[SD_DAT_SM].addr;
 	while (sd_pio->sm[SD_DAT_SM].addr != sd_cmd_or_dat_offset_no_arg_state_waiting_for_cmd)
-	{
-		printf("oops %d\n", (uint)sd_pio->sm[SD_DAT_SM].addr);
-	}
+		++spins;
+	if (spins)
+		trace(TRACE_PIO_WAIT, pc, spins < 0xFFFF ? spins : 0xFFFF);
+
+	trace(TRACE_DMA_START, sector_num, sector_count);
+
 	assert(sd_pio->sm[SD_DAT_SM].addr == sd_cmd_or_dat_offset_no_arg_state_waiting_for_cmd);
 	assert(pio_sm_is_tx_fifo_empty(sd_pio, SD_DAT_SM));
 	pio_sm_put(sd_pio, SD_DAT_SM, sd_pio_cmd(sd_cmd_or_dat_offset_state_inline_instruction, pio_encode_jmp(sd_cmd_or_dat_offset_no_arg_state_wait_high)));
@@ -986,10 +1067,15 @@ int sd_read_ext_csd(void *ext_csd)
 	}
 
 	// todo further state checks
+	uint32_t spins = 0;
+	uint32_t pc = sd_pio->sm[SD_DAT_SM].addr;
 	while (sd_pio->sm[SD_DAT_SM].addr != sd_cmd_or_dat_offset_no_arg_state_waiting_for_cmd)
-	{
-		printf("oops %d\n", (uint)sd_pio->sm[SD_DAT_SM].addr);
-	}
+		++spins;
+	if (spins)
+		trace(TRACE_PIO_WAIT, pc, spins < 0xFFFF ? spins : 0xFFFF);
+
+	trace(TRACE_DMA_START, 0, 1);
+
 	assert(sd_pio->sm[SD_DAT_SM].addr == sd_cmd_or_dat_offset_no_arg_state_waiting_for_cmd);
 	assert(pio_sm_is_rx_fifo_empty(sd_pio, SD_DAT_SM));
 
@@ -1011,8 +1097,11 @@ int sd_read_ext_csd(void *ext_csd)
 
 	uint32_t response;
 	int rc = sd_command(MMC_SEND_EXT_CSD, 0, &response);
-	if (!rc)
+	if (rc)
+		sd_read_abort();
+	else
 	{
+		read_ctrl = ctrl_words;
 		while (!sd_scatter_read_complete(&rc))
 		{
 			tight_loop_contents();
@@ -36,6 +36,7 @@ extern "C" {
 int sd_init();
 int sd_readblocks_sync(void *buf, uint32_t block, uint block_count);
 int sd_readblocks_async(void *buf, uint32_t block, uint block_count);
+int sd_readblocks_strided_async(void *buf, uint stride, uint32_t block, uint block_count);
 bool sd_scatter_read_complete(int *status);
 int sd_writeblocks_async(const void *data, uint32_t sector_num, uint sector_count);
 int sd_writeblocks_sync(const void *data, uint32_t sector_num, uint sector_count);
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+
+#include "sdk.h"
+#include "pio_spi.h"
+
+// Nothing is wired to the PIO SPI pins, MISO reads low
+
+const pio_program_t spi_cpha0_cs_program = {NULL, 0, -1};
+const pio_program_t spi_cpha1_cs_program = {NULL, 0, -1};
+
+uint pio_add_program(PIO pio, const pio_program_t *program)
+{
+	return 0;
+}
+
+void pio_remove_program(PIO pio, const pio_program_t *program, uint loaded_offset)
+{
+}
+
+void pio_spi_init(pio_spi_inst_t *spi, PIO pio, uint sm, float freq, uint n_bits, pio_spi_order_t order, bool cpha, bool cpol, uint pin_ss, uint pin_mosi, uint pin_miso)
+{
+	spi->pio = pio;
+	spi->sm = sm;
+	spi->prog = 0;
+	spi->order = order;
+}
+
+void pio_spi_write8_blocking(const pio_spi_inst_t *spi, const uint8_t *src, size_t len)
+{
+}
+
+void pio_spi_read8_blocking(const pio_spi_inst_t *spi, uint8_t *dst, size_t len)
+{
+	memset(dst, 0, len);
+}
+
+void pio_spi_write8_read8_blocking(const pio_spi_inst_t *spi, uint8_t *src, uint8_t *dst, size_t len)
+{
+	memset(dst, 0, len);
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdk.h"
+#include "sim.h"
+#include "sdio.h"
+
+// eMMC behind the sdio.h interface, backed by an image file. Asynchronous
+// transfers complete immediately.
+
+static uint8_t *emmc = NULL;
+static uint64_t emmc_sectors = 0;
+static bool emmc_probed = false;
+static int read_status = SD_OK;
+static int write_status = SD_OK;
+static struct sim_faults read_errors;
+
+bool emmc_present()
+{
+	if (!emmc_probed)
+	{
+		emmc_probed = true;
+
+		const char *path = getenv("PICOFLASHER_SIM_EMMC");
+		uint64_t size = 0;
+		if (path)
+			emmc = sim_map(path, &size, 0x00);
+		emmc_sectors = size / SD_SECTOR_SIZE;
+		sim_faults_parse(&read_errors, getenv("PICOFLASHER_SIM_EMMC_READ_ERRORS"));
+		if (emmc)
+			fprintf(stderr, "sim: emmc %llu sectors\n", (unsigned long long)emmc_sectors);
+	}
+
+	return emmc && emmc_sectors;
+}
+
+static bool emmc_range(uint32_t block, uint block_count)
+{
+	return emmc_present() && block_count && (uint64_t)block + block_count <= emmc_sectors;
+}
+
+int sd_init()
+{
+	return emmc_present() ? SD_OK : SD_ERR_STUCK;
+}
+
+int sd_readblocks_strided_async(void *buf, uint stride, uint32_t block, uint block_count)
+{
+	if (!emmc_range(block, block_count) || block_count > SDIO_MAX_BLOCK_COUNT)
+		return SD_ERR_BAD_PARAM;
+
+	for (uint i = 0; i < block_count; ++i)
+		memcpy((uint8_t *)buf + i * stride, &emmc[(uint64_t)(block + i) * SD_SECTOR_SIZE], SD_SECTOR_SIZE);
+
+	// like the hardware, a bad data CRC only shows on completion
+	read_status = sim_fault(&read_errors, block, block_count) ? SD_ERR_CRC : SD_OK;
+	return SD_OK;
+}
+
+int sd_readblocks_async(void *buf, uint32_t block, uint block_count)
+{
+	return sd_readblocks_strided_async(buf, SD_SECTOR_SIZE, block, block_count);
+}
+
+int sd_readblocks_sync(void *buf, uint32_t block, uint block_count)
+{
+	int rc = sd_readblocks_async(buf, block, block_count);
+	return rc ? rc : read_status;
+}
+
+bool sd_scatter_read_complete(int *status)
+{
+	if (status)
+		*status = read_status;
+	return true;
+}
+
+int sd_writeblocks_async(const void *data, uint32_t sector_num, uint sector_count)
+{
+	if (!emmc_range(sector_num, sector_count) || sector_count > SDIO_MAX_BLOCK_COUNT)
+		return SD_ERR_BAD_PARAM;
+
+	memcpy(&emmc[(uint64_t)sector_num * SD_SECTOR_SIZE], data, sector_count * SD_SECTOR_SIZE);
+
+	write_status = SD_OK;
+	return SD_OK;
+}
+
+int sd_writeblocks_sync(const void *data, uint32_t sector_num, uint sector_count)
+{
+	return sd_writeblocks_async(data, sector_num, sector_count);
+}
+
+bool sd_write_complete(int *status)
+{
+	if (status)
+		*status = write_status;
+	return true;
+}
+
+void sd_read_cid(void *cid)
+{
+	static const uint8_t sim_cid[16] = {0x15, 0x01, 0x00, 'S', 'I', 'M', 'M', 'M', 'C', 0x10};
+	memcpy(cid, sim_cid, sizeof(sim_cid));
+}
+
+void sd_read_csd(void *csd)
+{
+	memset(csd, 0, 16);
+}
+
+int sd_read_ext_csd(void *ext_csd)
+{
+	if (!emmc_present())
+		return SD_ERR_STUCK;
+
+	uint8_t *bytes = ext_csd;
+	memset(bytes, 0, 512);
+	bytes[192] = 5; // EXT_CSD_REV
+	uint32_t sectors = emmc_sectors;
+	memcpy(&bytes[212], &sectors, 4); // SEC_COUNT
+	return SD_OK;
+}
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sdk.h"
+#include "sim.h"
+#include "pins.h"
+
+__thread sio_hw_t sim_sio;
+pio_hw_t sim_pio[2] = {{0}, {1}};
+
+static uint32_t sys_hz = 125000000;
+static struct timespec boot;
+
+static bool gpio_out[30];
+static bool gpio_level[30];
+
+// Signals are handled on their own thread, the firmware threads inherit the
+// blocked mask
+static void *signal_main(void *arg)
+{
+	sigset_t *signals = arg;
+
+	while (1)
+	{
+		int signal;
+		sigwait(signals, &signal);
+
+		smc_report();
+		if (signal != SIGUSR1)
+			exit(0);
+	}
+
+	return NULL;
+}
+
+__attribute__((constructor)) static void sim_boot()
+{
+	static sigset_t signals;
+	pthread_t thread;
+
+	clock_gettime(CLOCK_MONOTONIC, &boot);
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	pthread_create(&thread, NULL, signal_main, &signals);
+}
+
+uint64_t sim_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - boot.tv_sec) * 1000000000 + now.tv_nsec - boot.tv_nsec;
+}
+
+void *sim_map(const char *path, uint64_t *size, uint8_t fill)
+{
+	if (!path)
+	{
+		void *map = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED)
+			return NULL;
+
+		if (fill)
+			memset(map, fill, *size);
+		return map;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		perror(path);
+		return NULL;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+
+	bool created = st.st_size == 0;
+	if (!*size || (!created && (uint64_t)st.st_size < *size))
+		*size = st.st_size;
+	if (*size && created && ftruncate(fd, *size))
+		*size = 0;
+
+	void *map = *size ? mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: cannot map image\n", path);
+		return NULL;
+	}
+
+	if (created && fill)
+		memset(map, fill, *size);
+	return map;
+}
+
+void sim_faults_parse(struct sim_faults *faults, const char *list)
+{
+	faults->count = 0;
+	while (list && *list && faults->count < SIM_MAX_FAULTS)
+	{
+		char *end;
+		struct sim_fault *fault = &faults->entries[faults->count++];
+		fault->lba = strtoul(list, &end, 0);
+		fault->left = *end == ':' ? strtoul(end + 1, &end, 0) : 0;
+		fault->always = fault->left == 0;
+		list = *end ? end + 1 : end;
+	}
+}
+
+bool sim_fault(struct sim_faults *faults, uint32_t lba, uint32_t count)
+{
+	bool failed = false;
+	for (uint32_t i = 0; i < faults->count; ++i)
+	{
+		struct sim_fault *fault = &faults->entries[i];
+		if (fault->lba - lba >= count)
+			continue;
+
+		if (fault->always)
+			failed = true;
+		else if (fault->left)
+		{
+			--fault->left;
+			failed = true;
+		}
+	}
+	return failed;
+}
+
+void gpio_init(uint gpio)
+{
+	gpio_out[gpio] = false;
+	gpio_level[gpio] = false;
+}
+
+void gpio_set_dir(uint gpio, bool out)
+{
+	gpio_out[gpio] = out;
+}
+
+void gpio_put(uint gpio, bool value)
+{
+	gpio_level[gpio] = value;
+}
+
+// An eMMC pulls its clock line up
+bool gpio_get(uint gpio)
+{
+	if (gpio == MMC_CLK_PIN && !gpio_out[gpio])
+		return emmc_present();
+
+	return gpio_level[gpio];
+}
+
+void gpio_pull_up(uint gpio)
+{
+}
+
+void gpio_set_function(uint gpio, enum gpio_function fn)
+{
+}
+
+void sleep_us(uint64_t us)
+{
+	struct timespec ts = {us / 1000000, (us % 1000000) * 1000};
+	nanosleep(&ts, NULL);
+}
+
+void sleep_ms(uint32_t ms)
+{
+	sleep_us((uint64_t)ms * 1000);
+}
+
+uint64_t time_us_64()
+{
+	return sim_ns() / 1000;
+}
+
+uint32_t board_millis()
+{
+	return sim_ns() / 1000000;
+}
+
+// Counts down at clk_sys like the real SysTick
+systick_hw_t *sim_systick()
+{
+	static __thread systick_hw_t systick;
+	systick.cvr = ~(uint32_t)(sim_ns() * (sys_hz / 1000000) / 1000) & 0x00FFFFFF;
+	return &systick;
+}
+
+timer_hw_t *sim_timer()
+{
+	static __thread timer_hw_t timer;
+	uint64_t us = time_us_64();
+	timer.timerawh = us >> 32;
+	timer.timerawl = us;
+	return &timer;
+}
+
+bool set_sys_clock_khz(uint32_t freq_khz, bool required)
+{
+	sys_hz = freq_khz * 1000;
+	return true;
+}
+
+uint32_t clock_get_hz(enum clock_index clk)
+{
+	return sys_hz;
+}
+
+bool clock_configure(enum clock_index clk, uint32_t src, uint32_t auxsrc, uint32_t src_freq, uint32_t freq)
+{
+	return true;
+}
+
+void vreg_set_voltage(int voltage)
+{
+}
+
+bool stdio_init_all()
+{
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	return true;
+}
+
+static void (*core1_entry)(void);
+
+static void *core1_main(void *arg)
+{
+	sim_sio.cpuid = 1;
+	core1_entry();
+	return NULL;
+}
+
+void multicore_launch_core1_with_stack(void (*entry)(void), uint32_t *stack_bottom, size_t stack_size_bytes)
+{
+	pthread_t thread;
+
+	core1_entry = entry;
+	pthread_create(&thread, NULL, core1_main, NULL);
+}
+
+void reset_usb_boot(uint32_t gpio_activity_pin_mask, uint32_t disable_interface_mask)
+{
+	printf("reboot to bootloader\n");
+	exit(0);
+}
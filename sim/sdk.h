@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __SIM_SDK_H__
+#define __SIM_SDK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Just enough of the Pico SDK to run the firmware as a Linux process. Core1
+// is a thread, the registers the firmware reads directly are emulated and
+// the spiex state machine on pio0 is wired to the virtual SMC in smc.c. The SDK headers the firmware
+// includes all resolve to this file.
+
+typedef unsigned int uint;
+
+#define GPIO_IN 0
+#define GPIO_OUT 1
+
+enum gpio_function
+{
+	GPIO_FUNC_SPI = 1,
+	GPIO_FUNC_SIO = 5,
+	GPIO_FUNC_NULL = 0x1F,
+};
+
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_put(uint gpio, bool value);
+bool gpio_get(uint gpio);
+void gpio_pull_up(uint gpio);
+void gpio_set_function(uint gpio, enum gpio_function fn);
+
+void sleep_ms(uint32_t ms);
+void sleep_us(uint64_t us);
+uint64_t time_us_64();
+uint32_t board_millis();
+
+static inline uint32_t time_us_32()
+{
+	return time_us_64();
+}
+
+static inline void tight_loop_contents()
+{
+}
+
+enum clock_index
+{
+	clk_sys = 5,
+	clk_peri = 6,
+};
+
+#define CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLK_SYS 0
+#define VREG_VOLTAGE_1_30 0xF
+
+bool set_sys_clock_khz(uint32_t freq_khz, bool required);
+uint32_t clock_get_hz(enum clock_index clk);
+bool clock_configure(enum clock_index clk, uint32_t src, uint32_t auxsrc, uint32_t src_freq, uint32_t freq);
+void vreg_set_voltage(int voltage);
+bool stdio_init_all();
+
+void multicore_launch_core1_with_stack(void (*entry)(void), uint32_t *stack_bottom, size_t stack_size_bytes);
+void reset_usb_boot(uint32_t gpio_activity_pin_mask, uint32_t disable_interface_mask);
+
+#define __dmb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+// Registers, refreshed from the host clock whenever they are dereferenced
+typedef volatile uint32_t io_rw_32;
+typedef volatile uint32_t io_ro_32;
+
+typedef struct
+{
+	io_ro_32 cpuid;
+} sio_hw_t;
+
+typedef struct
+{
+	io_rw_32 csr;
+	io_rw_32 rvr;
+	io_rw_32 cvr;
+	io_rw_32 calib;
+} systick_hw_t;
+
+typedef struct
+{
+	io_ro_32 timerawh;
+	io_ro_32 timerawl;
+} timer_hw_t;
+
+extern __thread sio_hw_t sim_sio;
+systick_hw_t *sim_systick();
+timer_hw_t *sim_timer();
+
+#define sio_hw (&sim_sio)
+#define systick_hw (sim_systick())
+#define timer_hw (sim_timer())
+
+// pio0 state machine 0 runs spiex.pio in front of the virtual SMC, nothing
+// is behind the PIO SPI pins on pio1
+typedef struct
+{
+	uint index;
+	io_rw_32 fdebug;
+} pio_hw_t;
+
+typedef pio_hw_t *PIO;
+
+extern pio_hw_t sim_pio[2];
+#define pio0 (&sim_pio[0])
+#define pio1 (&sim_pio[1])
+
+#define PIO_FDEBUG_TXSTALL_LSB 24
+
+typedef struct
+{
+	const uint16_t *instructions;
+	uint8_t length;
+	int8_t origin;
+} pio_program_t;
+
+uint pio_add_program(PIO pio, const pio_program_t *program);
+void pio_remove_program(PIO pio, const pio_program_t *program, uint loaded_offset);
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled);
+void pio_sm_put_blocking(PIO pio, uint sm, uint32_t data);
+uint32_t pio_sm_get_blocking(PIO pio, uint sm);
+
+extern const pio_program_t spiex_program;
+void spiex_program_init(PIO pio, uint sm, uint prog_offs, float clkdiv, bool sync, bool late, uint pin_ss, uint pin_mosi, uint pin_miso);
+
+extern const pio_program_t spi_cpha0_cs_program;
+extern const pio_program_t spi_cpha1_cs_program;
+
+#endif
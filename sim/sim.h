@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Configuration of the simulated console, read from the environment:
+//   PICOFLASHER_SIM_NAND          NAND image (raw 0x210 byte pages), created
+//                                 erased when missing, in memory if unset
+//   PICOFLASHER_SIM_FLASH_CONFIG  SMC flash config in hex, 00023010 by default
+//                                 (16MB small block), 008A3020 is 256MB with 128KB
+//                                 blocks, 008A3030 256MB with 256KB blocks
+//   PICOFLASHER_SIM_TIMING        tR,tPROG,tBERS in us instead of the
+//                                 defaults for the block size
+//   PICOFLASHER_SIM_REALTIME      1 to make every SPI transaction and NAND
+//                                 operation take its modelled time, needs a
+//                                 free host core for each firmware core
+//   PICOFLASHER_SIM_BAD_BLOCKS    comma separated erase blocks the
+//                                 controller reports bad, their reads flag
+//                                 it and programs and erases fail
+//   PICOFLASHER_SIM_READ_ERRORS   NAND pages whose reads never finish, see
+//                                 struct sim_faults for the format
+//   PICOFLASHER_SIM_MISO_DELAY    ns from the falling SCK edge until MISO is
+//                                 valid, reads sampled earlier come back
+//                                 shifted by a bit, 0 by default
+//   PICOFLASHER_SIM_EMMC          eMMC image, no card if unset
+//   PICOFLASHER_SIM_EMMC_READ_ERRORS  sectors whose reads fail with a CRC
+//                                 error, as PICOFLASHER_SIM_READ_ERRORS
+//   PICOFLASHER_SIM_PTY           symlink created to the CDC pseudo terminal
+//   PICOFLASHER_SIM_VENDOR_PTY    symlink created to the vendor interface's
+//                                 pseudo terminal
+
+// The NAND model keeps its own clock of SPI transfer and NAND busy time and
+// reports it, with the projected time of a full dump and flash, on SIGUSR1,
+// on exit and whenever the SMC is started again.
+
+uint64_t sim_ns();
+
+// Maps an image file shared, or anonymous memory without a path. A zero size
+// takes the size of the existing file.
+void *sim_map(const char *path, uint64_t *size, uint8_t fill);
+
+// Reads that fail, parsed from a comma separated list of lba[:n], where
+// only the first n reads covering lba fail, every one without n
+#define SIM_MAX_FAULTS 64
+
+struct sim_fault
+{
+	uint32_t lba;
+	uint32_t left;
+	bool always;
+};
+
+struct sim_faults
+{
+	uint32_t count;
+	struct sim_fault entries[SIM_MAX_FAULTS];
+};
+
+void sim_faults_parse(struct sim_faults *faults, const char *list);
+bool sim_fault(struct sim_faults *faults, uint32_t lba, uint32_t count);
+
+void smc_init();
+void smc_report();
+bool emmc_present();
+
+#endif
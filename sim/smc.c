@@ -0,0 +1,508 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdk.h"
+#include "sim.h"
+
+// The SMC's NAND controller as seen over spiex: a register file in front of a
+// page buffer and the NAND array. Programming only clears bits like real
+// flash, so a page that was not erased first reads back damaged.
+//
+// Every spiex transaction advances the model's clock by the PIO cycles
+// spiex.pio spends on it at the divider spiex_init() picked, and page reads,
+// programs and erases keep the status register busy for tR, tPROG and tBERS
+// on that clock.
+
+#define REG_CONFIG 0x00
+#define REG_STATUS 0x04
+#define REG_COMMAND 0x08
+#define REG_ADDRESS 0x0C
+#define REG_DATA 0x10
+
+#define CMD_PAGE_BUF_TO_REG 0x00
+#define CMD_REG_TO_PAGE_BUF 0x01
+#define CMD_PHY_PAGE_TO_BUF 0x03
+#define CMD_WRITE_PAGE_TO_PHY 0x04
+#define CMD_BLOCK_ERASE 0x05
+#define CMD_UNLOCK_1 0x55
+#define CMD_UNLOCK_2 0xAA
+
+#define CONFIG_WP_EN 0x08
+
+// libxenon's names, see xbox.h
+#define STATUS_BUSY 0x0001
+#define STATUS_BB_ER 0x0002
+#define STATUS_ILL_LOG 0x0008
+#define STATUS_ADDR_ER 0x0020
+
+#define PAGE_SIZE 0x210
+
+// spiex.pio: four cycles per bit plus about ten for the CSn porches, the
+// read/write branch and the turnaround
+#define SPIEX_BIT_CYCLES 4
+#define SPIEX_OVERHEAD_CYCLES 10
+
+// Typical datasheet values, ns
+struct timing
+{
+	uint32_t read;
+	uint32_t program;
+	uint32_t erase;
+};
+
+static const struct timing small_block_timing = {15000, 200000, 2000000};
+static const struct timing big_block_timing = {25000, 250000, 2000000};
+
+// Model time is accounted to the operation the register traffic belongs to
+enum phase
+{
+	PHASE_READ,
+	PHASE_PROGRAM,
+	PHASE_ERASE,
+	PHASE_OTHER,
+	PHASE_COUNT
+};
+
+static const char *phase_names[PHASE_COUNT] = {"read", "program", "erase", "other"};
+
+static struct
+{
+	uint64_t ns[PHASE_COUNT];
+	uint32_t operations[PHASE_COUNT];
+	uint64_t transactions;
+	uint64_t read_words; // data words moved out of the page buffer by reads
+} stats;
+
+static struct timing timing;
+static bool realtime = false;
+static uint32_t spi_hz = 0;
+static float pio_cycle_ns = 0;
+static float miso_delay_ns = 0; // SCK falling edge to MISO valid at the Pico
+static float sample_ns = 0;		// falling edge to the MISO sample
+static uint64_t clock_ns = 0;
+static uint64_t busy_until = 0;
+static enum phase phase = PHASE_OTHER;
+
+static bool enabled = false;
+
+static uint32_t config;
+static uint32_t status;
+static uint32_t address;
+static uint32_t data;
+static uint8_t unlock[2];
+
+static uint8_t buffer[PAGE_SIZE];
+
+static uint8_t *nand = NULL;
+static uint8_t *touched = NULL; // in memory NAND only
+static uint32_t nand_pages;
+static uint32_t block_pages;
+
+// Blocks the controller flags with STATUS_BB_ER, their programs and erases
+// fail and their pages read back as they are
+#define MAX_BAD_BLOCKS 64
+static uint32_t bad_blocks[MAX_BAD_BLOCKS];
+static uint32_t bad_block_count = 0;
+
+static struct sim_faults read_errors;
+
+// Flash configs of real consoles with the size of their part, taken from
+// dumps rather than decoded, so the model does not share a decode mistake
+// with xbox_nand_pages()
+static const struct
+{
+	uint32_t flash_config;
+	uint32_t size;
+	uint32_t block_size;
+} known_configs[] = {
+	{0x01198010, 0x1000000, 0x4000},   // Xenon to Falcon 16MB
+	{0x00023010, 0x1000000, 0x4000},   // Jasper 16MB
+	{0x00043000, 0x1000000, 0x4000},   // Trinity and Corona 16MB
+	{0x008A3020, 0x10000000, 0x20000}, // Jasper 256MB
+	{0x00AA3020, 0x20000000, 0x20000}, // Jasper 512MB
+};
+
+// Other configs follow libxenon's sfcx_init
+static void smc_geometry(uint32_t flash_config)
+{
+	for (uint32_t i = 0; i < sizeof(known_configs) / sizeof(known_configs[0]); ++i)
+		if (known_configs[i].flash_config == flash_config)
+		{
+			nand_pages = known_configs[i].size / 0x200;
+			block_pages = known_configs[i].block_size / 0x200;
+			return;
+		}
+
+	int major = (flash_config >> 17) & 3;
+	int minor = (flash_config >> 4) & 3;
+
+	// Majors 0 to 2 only, anything left undecoded stays 0
+	uint32_t size = 0;
+	uint32_t shift = ((flash_config >> 19) & 3) + ((flash_config >> 21) & 0xF) + 23;
+	if (major == 0)
+		size = minor ? 0x800000 << minor : 0;
+	else if (major > 2)
+		size = 0;
+	else if (minor >= 2)
+		size = shift < 32 ? 1u << shift : 0;
+	else if (minor == 1)
+		size = major == 1 ? 0x1000000 : 0x4000000;
+	else if (major == 2)
+		size = 0x1000000;
+
+	uint32_t block_size = 0x4000;
+	if (major >= 1 && minor == 2)
+		block_size = 0x20000;
+	else if (major >= 1 && minor == 3)
+		block_size = 0x40000;
+
+	nand_pages = size / 0x200;
+	block_pages = block_size / 0x200;
+}
+
+// Anonymous memory starts out zeroed, its blocks are erased on first use so
+// big NANDs cost no more memory than what is written
+static uint8_t *nand_page(uint32_t page)
+{
+	uint32_t block = page / block_pages;
+	if (touched && !touched[block])
+	{
+		touched[block] = 1;
+		memset(&nand[(uint64_t)block * block_pages * PAGE_SIZE], 0xFF, block_pages * PAGE_SIZE);
+	}
+
+	return &nand[(uint64_t)page * PAGE_SIZE];
+}
+
+void smc_init()
+{
+	if (nand)
+		return;
+
+	const char *flash_config = getenv("PICOFLASHER_SIM_FLASH_CONFIG");
+	config = flash_config ? strtoul(flash_config, NULL, 16) : 0x00023010;
+	smc_geometry(config);
+	if (!nand_pages)
+	{
+		fprintf(stderr, "sim: flash config %08x is not supported\n", config);
+		exit(1);
+	}
+
+	timing = block_pages > 0x4000 / 0x200 ? big_block_timing : small_block_timing;
+	const char *times = getenv("PICOFLASHER_SIM_TIMING");
+	if (times)
+	{
+		uint32_t read, program, erase;
+		if (sscanf(times, "%u,%u,%u", &read, &program, &erase) == 3)
+			timing = (struct timing){read * 1000, program * 1000, erase * 1000};
+	}
+
+	const char *mode = getenv("PICOFLASHER_SIM_REALTIME");
+	realtime = mode && atoi(mode);
+
+	const char *bad = getenv("PICOFLASHER_SIM_BAD_BLOCKS");
+	while (bad && *bad && bad_block_count < MAX_BAD_BLOCKS)
+	{
+		char *end;
+		bad_blocks[bad_block_count++] = strtoul(bad, &end, 0);
+		bad = *end ? end + 1 : end;
+	}
+
+	sim_faults_parse(&read_errors, getenv("PICOFLASHER_SIM_READ_ERRORS"));
+
+	const char *delay = getenv("PICOFLASHER_SIM_MISO_DELAY");
+	miso_delay_ns = delay ? atof(delay) : 0;
+
+	const char *path = getenv("PICOFLASHER_SIM_NAND");
+	uint64_t size = (uint64_t)nand_pages * PAGE_SIZE;
+	nand = sim_map(path, &size, 0xFF);
+	if (!nand)
+		exit(1);
+	if (size < (uint64_t)nand_pages * PAGE_SIZE)
+		nand_pages = size / PAGE_SIZE;
+	if (!path)
+		touched = calloc(nand_pages / block_pages + 1, 1);
+
+	fprintf(stderr, "sim: nand %u pages, %u per block, flash config %08x, tR %uus tPROG %uus tBERS %uus%s\n",
+			nand_pages, block_pages, config, timing.read / 1000, timing.program / 1000, timing.erase / 1000,
+			realtime ? ", realtime" : "");
+}
+
+static uint64_t smc_now()
+{
+	return realtime ? sim_ns() : clock_ns;
+}
+
+static void smc_busy(uint32_t ns)
+{
+	busy_until = smc_now() + ns;
+}
+
+static void smc_transaction(uint32_t bits)
+{
+	uint64_t ns = (bits * SPIEX_BIT_CYCLES + SPIEX_OVERHEAD_CYCLES) * pio_cycle_ns;
+
+	// Paced against a running deadline so the overshoot of one wait is made up
+	// by the next ones, idle time between commands is not
+	if (realtime)
+	{
+		static uint64_t deadline = 0;
+
+		uint64_t now = sim_ns();
+		if (deadline + 1000000 < now)
+			deadline = now;
+		deadline += ns;
+		while (sim_ns() < deadline)
+			;
+	}
+
+	clock_ns += ns;
+	stats.ns[phase] += ns;
+	++stats.transactions;
+}
+
+static void report_time(const char *name, uint64_t ns)
+{
+	if (ns)
+		fprintf(stderr, "  %-12s %10.1f s\n", name, ns / 1e9);
+	else
+		fprintf(stderr, "  %-12s %10s\n", name, "-");
+}
+
+// Full dump and flash as the firmware did its operations so far
+void smc_report()
+{
+	if (!nand)
+		return;
+
+	fprintf(stderr, "sim: nand model, %llu spi transactions at %.1f MHz, %.3f s\n",
+			(unsigned long long)stats.transactions, spi_hz / 1e6, clock_ns / 1e9);
+
+	uint64_t per_op[PHASE_COUNT] = {0};
+	for (int i = 0; i < PHASE_COUNT; ++i)
+	{
+		if (stats.operations[i])
+			per_op[i] = stats.ns[i] / stats.operations[i];
+
+		if (i != PHASE_OTHER)
+			fprintf(stderr, "  %-12s %10u ops %10.1f us/op\n", phase_names[i], stats.operations[i], per_op[i] / 1e3);
+		else
+			fprintf(stderr, "  %-12s %25.1f us\n", phase_names[i], stats.ns[i] / 1e3);
+	}
+
+	// A flash whose blocks were not erased so far still has to erase them
+	if (!per_op[PHASE_ERASE])
+		per_op[PHASE_ERASE] = timing.erase;
+
+	// Spare only reads move a few words instead of the whole page. Each word
+	// is a command write and a data read, the rest of a read is per page.
+	if (stats.operations[PHASE_READ])
+	{
+		uint64_t word_ns = ((40 + 48) * SPIEX_BIT_CYCLES + 2 * SPIEX_OVERHEAD_CYCLES) * pio_cycle_ns;
+		uint64_t page_ns = (stats.ns[PHASE_READ] - stats.read_words * word_ns) / stats.operations[PHASE_READ];
+		per_op[PHASE_READ] = page_ns + PAGE_SIZE / 4 * word_ns;
+	}
+
+	uint32_t blocks = nand_pages / block_pages;
+	report_time("full dump", (uint64_t)nand_pages * per_op[PHASE_READ]);
+	report_time("full flash", per_op[PHASE_PROGRAM] ? (uint64_t)blocks * per_op[PHASE_ERASE] + (uint64_t)nand_pages * per_op[PHASE_PROGRAM] : 0);
+}
+
+static bool smc_bad_block(uint32_t page)
+{
+	for (uint32_t i = 0; i < bad_block_count; ++i)
+		if (bad_blocks[i] == page / block_pages)
+			return true;
+	return false;
+}
+
+static bool smc_unlocked(uint8_t first, uint8_t second)
+{
+	return unlock[0] == first && unlock[1] == second;
+}
+
+static void smc_command(uint8_t cmd)
+{
+	uint32_t page = address >> 9;
+
+	// Filling the page buffer starts a program
+	if (cmd == CMD_REG_TO_PAGE_BUF)
+		phase = PHASE_PROGRAM;
+
+	if (cmd == CMD_PAGE_BUF_TO_REG)
+	{
+		memcpy(&data, &buffer[address % PAGE_SIZE & ~3], 4);
+		address += 4;
+		if (phase == PHASE_READ)
+			++stats.read_words;
+	}
+	else if (cmd == CMD_REG_TO_PAGE_BUF)
+	{
+		memcpy(&buffer[address % PAGE_SIZE & ~3], &data, 4);
+		address += 4;
+	}
+	else if (cmd == CMD_PHY_PAGE_TO_BUF)
+	{
+		phase = PHASE_READ;
+		++stats.operations[PHASE_READ];
+
+		if (page >= nand_pages)
+			status |= STATUS_ADDR_ER;
+		else
+			memcpy(buffer, nand_page(page), PAGE_SIZE);
+		if (smc_bad_block(page))
+			status |= STATUS_BB_ER;
+		// Stays busy far beyond any wait for ready
+		smc_busy(sim_fault(&read_errors, page, 1) ? UINT32_MAX : timing.read);
+	}
+	else if (cmd == CMD_WRITE_PAGE_TO_PHY)
+	{
+		if (page >= nand_pages)
+			status |= STATUS_ADDR_ER;
+		else if (!smc_unlocked(CMD_UNLOCK_1, CMD_UNLOCK_2))
+			status |= STATUS_ILL_LOG;
+		else if (smc_bad_block(page))
+			status |= STATUS_BB_ER;
+		else
+		{
+			uint8_t *data = nand_page(page);
+			for (uint32_t i = 0; i < PAGE_SIZE; ++i)
+				data[i] &= buffer[i];
+			smc_busy(timing.program);
+		}
+		++stats.operations[PHASE_PROGRAM];
+	}
+	else if (cmd == CMD_BLOCK_ERASE)
+	{
+		if (page >= nand_pages)
+			status |= STATUS_ADDR_ER;
+		else if (!smc_unlocked(CMD_UNLOCK_2, CMD_UNLOCK_1) || !(config & CONFIG_WP_EN))
+			status |= STATUS_ILL_LOG;
+		else if (smc_bad_block(page))
+			status |= STATUS_BB_ER;
+		else
+		{
+			memset(nand_page(page - page % block_pages), 0xFF, block_pages * PAGE_SIZE);
+			smc_busy(timing.erase);
+		}
+		phase = PHASE_ERASE;
+		++stats.operations[PHASE_ERASE];
+	}
+	else if (cmd != CMD_UNLOCK_1 && cmd != CMD_UNLOCK_2)
+	{
+		status |= STATUS_ILL_LOG;
+	}
+
+	unlock[0] = unlock[1];
+	unlock[1] = cmd;
+}
+
+static uint32_t smc_read(uint8_t reg)
+{
+	if (reg == REG_CONFIG)
+		return config;
+	if (reg == REG_STATUS)
+		return status | (smc_now() < busy_until ? STATUS_BUSY : 0);
+	if (reg == REG_ADDRESS)
+		return address;
+	if (reg == REG_DATA)
+		return data;
+	return 0;
+}
+
+static void smc_write(uint8_t reg, uint32_t value)
+{
+	if (reg == REG_CONFIG)
+		config = value;
+	else if (reg == REG_STATUS)
+		status &= ~value; // write one to clear
+	else if (reg == REG_COMMAND)
+		smc_command(value);
+	else if (reg == REG_ADDRESS)
+		address = value;
+	else if (reg == REG_DATA)
+		data = value;
+}
+
+const pio_program_t spiex_program = {NULL, 0, -1};
+
+// Header word of a write, until its value arrives
+static uint32_t write_header;
+static bool write_pending = false;
+static uint32_t rx_value;
+
+void spiex_program_init(PIO pio, uint sm, uint prog_offs, float clkdiv, bool sync, bool late, uint pin_ss, uint pin_mosi, uint pin_miso)
+{
+	float sys_ns = 1e9f / clock_get_hz(clk_sys);
+
+	pio_cycle_ns = clkdiv * sys_ns;
+	spi_hz = clock_get_hz(clk_sys) / (SPIEX_BIT_CYCLES * clkdiv);
+
+	// Half a bit after the falling edge, see spiex.pio
+	sample_ns = 2 * pio_cycle_ns + (late ? pio_cycle_ns : 0) - (sync ? 2 * sys_ns : 0);
+	write_pending = false;
+
+	smc_init();
+	enabled = true;
+}
+
+void pio_sm_set_enabled(PIO pio, uint sm, bool enable)
+{
+	if (pio == pio0 && !enable && enabled)
+	{
+		smc_report();
+		enabled = false;
+	}
+}
+
+// The state machine never stalls, so a register read is answered as soon as
+// its header is pushed
+void pio_sm_put_blocking(PIO pio, uint sm, uint32_t data)
+{
+	pio->fdebug |= 1u << (PIO_FDEBUG_TXSTALL_LSB + sm);
+	if (pio != pio0 || !enabled)
+		return;
+
+	if (write_pending)
+	{
+		write_pending = false;
+		smc_transaction(40);
+		smc_write((write_header & 0xFF) >> 2, data);
+	}
+	else if (data & 0x100)
+	{
+		smc_transaction(48);
+		rx_value = smc_read((data & 0xFF) >> 2);
+
+		// Sampled before MISO settled, every bit is the one before it
+		if (miso_delay_ns > sample_ns)
+			rx_value <<= 1;
+	}
+	else
+	{
+		write_header = data;
+		write_pending = true;
+	}
+}
+
+uint32_t pio_sm_get_blocking(PIO pio, uint sm)
+{
+	return pio == pio0 ? rx_value : 0;
+}
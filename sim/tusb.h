@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __SIM_TUSB_H__
+#define __SIM_TUSB_H__
+
+#include "sdk.h"
+
+// The CDC and vendor interfaces are pseudo terminals (see usb.c), the MSC
+// interface is never mounted.
+
+bool tusb_init();
+void tud_task();
+
+uint32_t tud_cdc_available();
+bool tud_cdc_peek(uint8_t *byte);
+uint32_t tud_cdc_read(void *buffer, uint32_t length);
+uint32_t tud_cdc_write(const void *buffer, uint32_t length);
+uint32_t tud_cdc_write_flush();
+uint32_t tud_cdc_write_available();
+
+bool tud_vendor_mounted();
+uint32_t tud_vendor_available();
+bool tud_vendor_peek(uint8_t *byte);
+uint32_t tud_vendor_read(void *buffer, uint32_t length);
+uint32_t tud_vendor_write(const void *buffer, uint32_t length);
+uint32_t tud_vendor_write_flush();
+uint32_t tud_vendor_write_available();
+
+enum
+{
+	SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL = 0x1E,
+};
+
+enum
+{
+	SCSI_SENSE_NOT_READY = 0x02,
+	SCSI_SENSE_MEDIUM_ERROR = 0x03,
+	SCSI_SENSE_ILLEGAL_REQUEST = 0x05,
+	SCSI_SENSE_DATA_PROTECT = 0x07,
+};
+
+bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier);
+
+// Implemented by the firmware
+void tud_mount_cb(void);
+void tud_umount_cb(void);
+void tud_cdc_rx_cb(uint8_t itf);
+void tud_cdc_tx_complete_cb(uint8_t itf);
+void tud_vendor_rx_cb(uint8_t itf);
+
+#endif
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+
+#include "tusb.h"
+
+// CDC and vendor FIFOs in front of a pseudo terminal each, sized like the
+// device's. Both are mounted from the first tud_task() on and stay mounted,
+// host tools open the printed paths like the real /dev/ttyACM or the vendor
+// interface's bulk endpoints.
+
+#define CDC_FIFO_SIZE (1024 * 8)
+#define VENDOR_RX_SIZE (1024 * 8)
+#define VENDOR_TX_SIZE (1024 * 16)
+
+struct sim_port
+{
+	int master;
+	int slave;
+	uint8_t *rx;
+	uint32_t rx_size;
+	uint32_t rx_length;
+	uint8_t *tx;
+	uint32_t tx_size;
+	uint32_t tx_length;
+};
+
+static uint8_t cdc_rx_buf[CDC_FIFO_SIZE];
+static uint8_t cdc_tx_buf[CDC_FIFO_SIZE];
+static uint8_t vendor_rx_buf[VENDOR_RX_SIZE];
+static uint8_t vendor_tx_buf[VENDOR_TX_SIZE];
+
+static struct sim_port cdc = {-1, -1, cdc_rx_buf, sizeof(cdc_rx_buf), 0, cdc_tx_buf, sizeof(cdc_tx_buf), 0};
+static struct sim_port vendor = {-1, -1, vendor_rx_buf, sizeof(vendor_rx_buf), 0, vendor_tx_buf, sizeof(vendor_tx_buf), 0};
+static bool mounted = false;
+
+static void port_open(struct sim_port *port, const char *name, const char *link)
+{
+	port->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (port->master < 0 || grantpt(port->master) || unlockpt(port->master))
+	{
+		perror("sim: pty");
+		exit(1);
+	}
+
+	// Holding the slave open keeps the master usable while no tool is
+	// attached
+	port->slave = open(ptsname(port->master), O_RDWR | O_NOCTTY);
+
+	struct termios tio;
+	tcgetattr(port->slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(port->slave, TCSANOW, &tio);
+
+	fcntl(port->master, F_SETFL, fcntl(port->master, F_GETFL) | O_NONBLOCK);
+
+	if (link)
+	{
+		unlink(link);
+		if (symlink(ptsname(port->master), link))
+			perror(link);
+	}
+
+	fprintf(stderr, "sim: %s on %s\n", name, ptsname(port->master));
+}
+
+bool tusb_init()
+{
+	port_open(&cdc, "cdc", getenv("PICOFLASHER_SIM_PTY"));
+	port_open(&vendor, "vendor", getenv("PICOFLASHER_SIM_VENDOR_PTY"));
+	return true;
+}
+
+static bool port_tx(struct sim_port *port)
+{
+	if (!port->tx_length)
+		return false;
+
+	ssize_t written = write(port->master, port->tx, port->tx_length);
+	if (written <= 0)
+		return false;
+
+	memmove(port->tx, &port->tx[written], port->tx_length - written);
+	port->tx_length -= written;
+	return true;
+}
+
+static bool port_rx(struct sim_port *port)
+{
+	if (port->rx_length == port->rx_size)
+		return false;
+
+	ssize_t length = read(port->master, &port->rx[port->rx_length], port->rx_size - port->rx_length);
+	if (length <= 0)
+		return false;
+
+	port->rx_length += length;
+	return true;
+}
+
+void tud_task()
+{
+	if (!mounted)
+	{
+		mounted = true;
+		tud_mount_cb();
+	}
+
+	if (port_rx(&cdc))
+		tud_cdc_rx_cb(0);
+	if (port_tx(&cdc))
+		tud_cdc_tx_complete_cb(0);
+	if (port_rx(&vendor))
+		tud_vendor_rx_cb(0);
+	port_tx(&vendor);
+}
+
+static bool port_peek(struct sim_port *port, uint8_t *byte)
+{
+	if (!port->rx_length)
+		return false;
+
+	*byte = port->rx[0];
+	return true;
+}
+
+static uint32_t port_read(struct sim_port *port, void *buffer, uint32_t length)
+{
+	if (length > port->rx_length)
+		length = port->rx_length;
+
+	memcpy(buffer, port->rx, length);
+	memmove(port->rx, &port->rx[length], port->rx_length - length);
+	port->rx_length -= length;
+	return length;
+}
+
+static uint32_t port_write(struct sim_port *port, const void *buffer, uint32_t length)
+{
+	if (length > port->tx_size - port->tx_length)
+		length = port->tx_size - port->tx_length;
+
+	memcpy(&port->tx[port->tx_length], buffer, length);
+	port->tx_length += length;
+	return length;
+}
+
+static uint32_t port_flush(struct sim_port *port)
+{
+	uint32_t length = port->tx_length;
+	port_tx(port);
+	return length - port->tx_length;
+}
+
+uint32_t tud_cdc_available()
+{
+	return cdc.rx_length;
+}
+
+bool tud_cdc_peek(uint8_t *byte)
+{
+	return port_peek(&cdc, byte);
+}
+
+uint32_t tud_cdc_read(void *buffer, uint32_t length)
+{
+	return port_read(&cdc, buffer, length);
+}
+
+uint32_t tud_cdc_write(const void *buffer, uint32_t length)
+{
+	return port_write(&cdc, buffer, length);
+}
+
+uint32_t tud_cdc_write_flush()
+{
+	return port_flush(&cdc);
+}
+
+uint32_t tud_cdc_write_available()
+{
+	return cdc.tx_size - cdc.tx_length;
+}
+
+bool tud_vendor_mounted()
+{
+	return mounted;
+}
+
+uint32_t tud_vendor_available()
+{
+	return vendor.rx_length;
+}
+
+bool tud_vendor_peek(uint8_t *byte)
+{
+	return port_peek(&vendor, byte);
+}
+
+uint32_t tud_vendor_read(void *buffer, uint32_t length)
+{
+	return port_read(&vendor, buffer, length);
+}
+
+uint32_t tud_vendor_write(const void *buffer, uint32_t length)
+{
+	return port_write(&vendor, buffer, length);
+}
+
+uint32_t tud_vendor_write_flush()
+{
+	return port_flush(&vendor);
+}
+
+uint32_t tud_vendor_write_available()
+{
+	return vendor.tx_size - vendor.tx_length;
+}
+
+bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier)
+{
+	return true;
+}
@@ -15,117 +15,198 @@
  */
 
 #include "pico/stdlib.h"
+#include "hardware/pio.h"
+#include "hardware/clocks.h"
 #include "pins.h"
+#include "perf.h"
+#include "protocol.h"
+#include "spiex.h"
+#include "spiex.pio.h"
 
-#if 0
-#include "pio_spi.h"
+#if !PICOFLASHER_HOST
+#include "hardware/dma.h"
 
-pio_spi_inst_t spi;
+static void spiex_burst_init();
+#endif
 
-void spiex_init()
+// Header words of spiex.pio
+#define SPIEX_READ(reg) (((reg) << 2) | 1 | 0x100)
+#define SPIEX_WRITE(reg) (((reg) << 2) | 2)
+
+#define SPIEX_BAUDRATE (28 * 1000 * 1000)
+
+PIO spiex_pio = pio0;
+const uint spiex_sm = 0;
+
+static uint spiex_offset;
+static bool running = false;
+
+// Bus timing, kept across SMC start/stop until the device resets. The
+// divider is in half steps, so every half bit (two PIO cycles) is a whole
+// number of system clocks.
+static uint32_t timing_clkdiv = 0;
+static uint32_t timing_sample = SMC_SAMPLE_EDGE;
+
+// The first half step at or below SPIEX_BAUDRATE, 266MHz gives the 26.6MHz
+// the hardware SPI used to run at
+static uint32_t spiex_default_clkdiv()
 {
-	pio_spi_init(&spi, pio0, 0, 18.f, 8, SPI_LSB_FIRST, false, false, SPI_SS_N, SPI_MOSI, SPI_MISO);
+	uint32_t sys = clock_get_hz(clk_sys);
+	return (sys + 2 * SPIEX_BAUDRATE - 1) / (2 * SPIEX_BAUDRATE);
 }
 
-void spiex_deinit()
+uint32_t spiex_baudrate(uint32_t clkdiv)
 {
-	pio_remove_program(spi.pio, &spi_cpha0_cs_program, spi.prog);
+	return clock_get_hz(clk_sys) / (2 * clkdiv);
 }
 
-uint32_t spiex_read_reg(uint8_t reg)
+void spiex_init()
 {
-	uint8_t txbuf[] = {(reg << 2) | 1, 0xFF, 0x00, 0x00, 0x00, 0x00};
-	uint8_t rxbuf[sizeof(txbuf)];
+	if (!timing_clkdiv)
+		timing_clkdiv = spiex_default_clkdiv();
+
+	spiex_offset = pio_add_program(spiex_pio, &spiex_program);
 
-	pio_spi_write8_read8_blocking(&spi, txbuf, rxbuf, sizeof(txbuf));
+	// SCK is the pin after SPI_SS_N
+	spiex_program_init(spiex_pio, spiex_sm, spiex_offset, timing_clkdiv / 2.f,
+					   timing_sample == SMC_SAMPLE_EARLY, timing_sample == SMC_SAMPLE_LATE,
+					   SPI_SS_N, SPI_MOSI, SPI_MISO);
+	running = true;
 
-	return *(uint32_t *)&rxbuf[2];
+#if !PICOFLASHER_HOST
+	spiex_burst_init();
+#endif
 }
 
-void spiex_write_reg(uint8_t reg, uint32_t val)
+bool spiex_running()
 {
-	uint8_t txbuf[] = {(reg << 2) | 2, 0x00, 0x00, 0x00, 0x00};
-
-	*(uint32_t *)&txbuf[1] = val;
-
-	pio_spi_write8_blocking(&spi, txbuf, sizeof(txbuf));
+	return running;
 }
-#endif
-#include "hardware/spi.h"
 
-void spiex_init()
+void spiex_set_timing(uint32_t clkdiv, uint32_t sample)
 {
-	spi_init(spi0, 28 * 1000 * 1000);
+	bool restart = running;
+	if (restart)
+		spiex_deinit();
 
-	gpio_set_function(SPI_MISO, GPIO_FUNC_SPI);
-	gpio_pull_up(SPI_MISO);
-	gpio_init(SPI_SS_N);
-	gpio_set_function(SPI_CLK, GPIO_FUNC_SPI);
-	gpio_set_function(SPI_MOSI, GPIO_FUNC_SPI);
+	timing_clkdiv = clkdiv;
+	timing_sample = sample;
 
-	gpio_init(SPI_SS_N);
-	gpio_put(SPI_SS_N, 1);
-	gpio_set_dir(SPI_SS_N, GPIO_OUT);
+	if (restart)
+		spiex_init();
 }
 
-void spiex_deinit()
+void spiex_get_timing(uint32_t *clkdiv, uint32_t *sample)
 {
-	spi_deinit(spi0);
+	if (!timing_clkdiv)
+		timing_clkdiv = spiex_default_clkdiv();
+
+	*clkdiv = timing_clkdiv;
+	*sample = timing_sample;
 }
 
-static uint8_t lsb2msb[] = 
+void spiex_deinit()
 {
-	0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0, 
-	0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8, 0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8, 
-	0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4, 0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4, 
-	0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec, 0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc, 
-	0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2, 0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2, 
-	0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea, 0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa, 
-	0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6, 0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6, 
-	0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee, 0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe, 
-	0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1, 0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1, 
-	0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9, 0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9, 
-	0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5, 0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5, 
-	0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed, 0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd, 
-	0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3, 0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3, 
-	0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb, 0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb, 
-	0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7, 0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7, 
-	0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef, 0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff, 
-};
+	if (!running)
+		return;
 
-uint32_t spiex_read_reg(uint8_t reg)
-{
-	uint8_t txbuf[] = {(reg << 2) | 1, 0xFF, 0x00, 0x00, 0x00, 0x00};
-	uint8_t rxbuf[sizeof(txbuf)];
+	// Register writes are only queued, let them reach the SMC first
+	uint32_t stall = 1u << (PIO_FDEBUG_TXSTALL_LSB + spiex_sm);
+	spiex_pio->fdebug = stall;
+	while (!(spiex_pio->fdebug & stall))
+		tight_loop_contents();
 
-	for (int i = 0; i < sizeof(txbuf); i++)
-		txbuf[i] = lsb2msb[txbuf[i]];
+	pio_sm_set_enabled(spiex_pio, spiex_sm, false);
+	pio_remove_program(spiex_pio, &spiex_program, spiex_offset);
+	running = false;
 
-	gpio_put(SPI_SS_N, 0);
+	gpio_init(SPI_SS_N);
+	gpio_put(SPI_SS_N, 1);
+	gpio_set_dir(SPI_SS_N, GPIO_OUT);
+}
 
-	spi_write_read_blocking(spi0, txbuf, rxbuf, sizeof(txbuf));
+uint32_t spiex_read_reg(uint8_t reg)
+{
+	uint32_t start = perf_cycles();
 
-	gpio_put(SPI_SS_N, 1);
+	pio_sm_put_blocking(spiex_pio, spiex_sm, SPIEX_READ(reg));
+	uint32_t val = pio_sm_get_blocking(spiex_pio, spiex_sm);
 
-	for (int i = 0; i < sizeof(rxbuf); i++)
-		rxbuf[i] = lsb2msb[rxbuf[i]];
+	perf_count(PERF_SPI_READ, perf_elapsed(start));
 
-	return *(uint32_t *)&rxbuf[2];
+	return val;
 }
 
 void spiex_write_reg(uint8_t reg, uint32_t val)
 {
+	uint32_t start = perf_cycles();
 
-	uint8_t txbuf[] = {(reg << 2) | 2, 0x00, 0x00, 0x00, 0x00};
+	pio_sm_put_blocking(spiex_pio, spiex_sm, SPIEX_WRITE(reg));
+	pio_sm_put_blocking(spiex_pio, spiex_sm, val);
 
-	*(uint32_t *)&txbuf[1] = val;
+	perf_count(PERF_SPI_WRITE, perf_elapsed(start));
+}
 
-	for (int i = 0; i < sizeof(txbuf); i++)
-		txbuf[i] = lsb2msb[txbuf[i]];
+#if !PICOFLASHER_HOST
+// Page buffer reads as one DMA transfer each way. Every word of a burst is
+// the same three tx words, command 0x00 to reg 0x08 and a read of reg 0x10,
+// so tx streams from a table built once and rx lands in the caller's buffer.
 
-	gpio_put(SPI_SS_N, 0);
+const int spiex_tx_dma_channel = 5;
+const int spiex_rx_dma_channel = 4;
 
-	spi_write_blocking(spi0, txbuf, sizeof(txbuf));
+static uint32_t burst_tx[SPIEX_BURST_MAX_WORDS * 3];
 
-	gpio_put(SPI_SS_N, 1);
+static void spiex_burst_init()
+{
+	for (int i = 0; i < SPIEX_BURST_MAX_WORDS; ++i)
+	{
+		burst_tx[i * 3] = SPIEX_WRITE(0x08);
+		burst_tx[i * 3 + 1] = 0x00;
+		burst_tx[i * 3 + 2] = SPIEX_READ(0x10);
+	}
+
+	dma_channel_config c = dma_channel_get_default_config(spiex_tx_dma_channel);
+	channel_config_set_read_increment(&c, true);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, pio_get_dreq(spiex_pio, spiex_sm, true));
+	dma_channel_configure(spiex_tx_dma_channel, &c, &spiex_pio->txf[spiex_sm], burst_tx, 0, false);
+
+	c = dma_channel_get_default_config(spiex_rx_dma_channel);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, true);
+	channel_config_set_dreq(&c, pio_get_dreq(spiex_pio, spiex_sm, false));
+	dma_channel_configure(spiex_rx_dma_channel, &c, NULL, &spiex_pio->rxf[spiex_sm], 0, false);
+}
+
+void spiex_read_burst(uint32_t *data, uint32_t words)
+{
+	uint32_t start = perf_cycles();
+
+	dma_channel_transfer_to_buffer_now(spiex_rx_dma_channel, data, words);
+	dma_channel_transfer_from_buffer_now(spiex_tx_dma_channel, burst_tx, words * 3);
+	dma_channel_wait_for_finish_blocking(spiex_rx_dma_channel);
+
+	// Every word is a register write and read, as on the register path.
+	// Only the whole burst is timed, each gets half of a word's share.
+	uint32_t elapsed = perf_elapsed(start);
+	uint32_t per_word = words ? elapsed / words : 0;
+	perf_count_many(PERF_SPI_WRITE, words, per_word / 2);
+	perf_count_many(PERF_SPI_READ, words, per_word - per_word / 2);
+	perf_count(PERF_SPI_BURST, elapsed);
 }
+#else
+// No DMA in the simulator, the same transactions one by one
+void spiex_read_burst(uint32_t *data, uint32_t words)
+{
+	uint32_t start = perf_cycles();
+
+	for (uint32_t i = 0; i < words; ++i)
+	{
+		spiex_write_reg(0x08, 0x00);
+		data[i] = spiex_read_reg(0x10);
+	}
+
+	perf_count(PERF_SPI_BURST, perf_elapsed(start));
+}
+#endif
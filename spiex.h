@@ -18,11 +18,25 @@
 #define __SPIEX_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 
 void spiex_init();
 void spiex_deinit();
+bool spiex_running();
 
+// Clock divider in half PIO steps and SMC_SAMPLE_* point, applied right away
+// if the bus is running and kept for every later spiex_init
+void spiex_set_timing(uint32_t clkdiv, uint32_t sample);
+void spiex_get_timing(uint32_t *clkdiv, uint32_t *sample);
+uint32_t spiex_baudrate(uint32_t clkdiv);
+
+// Writes are only queued, they reach the SMC ahead of any later read
 uint32_t spiex_read_reg(uint8_t reg);
 void spiex_write_reg(uint8_t reg, uint32_t val);
 
+// Reads words from the NAND page buffer (command 0x00, then register 0x10
+// per word) without the CPU touching the individual transactions
+#define SPIEX_BURST_MAX_WORDS (0x210 / 4)
+void spiex_read_burst(uint32_t *data, uint32_t words);
+
 #endif
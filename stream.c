@@ -0,0 +1,542 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "tusb.h"
+#include "xbox.h"
+#include "sdio.h"
+#include "perf.h"
+#include "engine.h"
+#include "stream.h"
+#include "host.h"
+#include "lz.h"
+#include "trace.h"
+
+// Pages are read on core1 straight into reply slots, ahead of core0 draining
+// them over USB. eMMC fills SDIO_MAX_BLOCK_COUNT slots per CMD23/CMD18, NAND
+// one page per pass. With STREAM_FLAG_COMPRESS every page is turned into a
+// record before its slot is committed.
+
+volatile uint32_t stream_generation = 0;
+
+static uint32_t generation = 0;
+static bool framed = false;
+static uint16_t seq = 0;
+static volatile uint8_t port = PORT_CDC;
+static volatile bool do_stream = false;
+static enum stream_source source = STREAM_NAND;
+static uint64_t stream_next = 0;
+static uint64_t stream_end = 0;
+static uint32_t pending = 0;
+
+static uint32_t stream_flags = 0;
+static uint32_t flags = 0; // latched by stream_start
+
+// Pages of a single byte value not sent yet
+static struct
+{
+	uint32_t lba;
+	uint32_t count;
+	uint8_t value;
+} run;
+
+static struct perf_wait flash_wait; // core0
+static struct perf_wait usb_wait;	// core1
+static uint64_t stream_pages = 0;
+static uint64_t stream_bytes = 0;
+static uint64_t stream_retries = 0;
+static uint64_t stream_failed = 0;
+
+// eMMC pages left to read one at a time, after a batch failed
+static uint32_t isolate = 0;
+static uint32_t attempts = 0; // retries of the current eMMC batch
+
+// Starting a stream drops the pages of a previous one still in the reply
+// queue, so a host recovering from a transfer error can restart at the last
+// page it got. Called on core0 as soon as a stream command is parsed; replies
+// tagged with an older generation are discarded from then on. What already
+// went into the USB FIFO is sent, it may hold replies to earlier commands.
+void stream_cancel()
+{
+	++stream_generation;
+
+	perf_wait_reset(&flash_wait);
+}
+
+void stream_update_flash_wait(bool starved)
+{
+	starved = starved && host_write_available(port) >= REPLY_DATA_SIZE;
+	perf_wait_update(&flash_wait, starved && do_stream);
+}
+
+static uint32_t record_write(uint8_t *out, uint32_t lba, uint32_t count, uint8_t type, uint8_t value, const void *data, uint32_t length)
+{
+	struct stream_record record;
+	record.lba = lba;
+	record.count = count;
+	record.length = length;
+	record.type = type;
+	record.value = value;
+	record.reserved = 0;
+
+	// Without data the payload is already in place behind the record
+	memcpy(out, &record, sizeof(record));
+	if (data)
+		memcpy(out + sizeof(record), data, length);
+	return sizeof(record) + length;
+}
+
+static uint32_t run_flush(uint8_t *out)
+{
+	if (!run.count)
+		return 0;
+
+	uint32_t length = record_write(out, run.lba, run.count, STREAM_RECORD_FILL, run.value, NULL, 0);
+	run.count = 0;
+	return length;
+}
+
+static bool page_fill_value(const uint8_t *page, uint32_t size, uint8_t *value)
+{
+	const uint32_t *words = (const uint32_t *)page;
+	uint32_t first = words[0];
+
+	if (first != (first & 0xFF) * 0x01010101)
+		return false;
+
+	for (uint32_t i = 1; i < size / 4; ++i)
+		if (words[i] != first)
+			return false;
+
+	*value = first;
+	return true;
+}
+
+// Turns a page into records at out, returns their length. Uniform pages
+// only extend the pending run, which is sent ahead of the next other record.
+static uint32_t page_pack(uint8_t *out, uint32_t lba, const uint8_t *page, uint32_t size)
+{
+	uint32_t length = 0;
+	uint8_t value;
+
+	if (page_fill_value(page, size, &value))
+	{
+		if (run.count && run.value == value && run.count < 0xFFFF)
+		{
+			++run.count;
+			return 0;
+		}
+
+		length = run_flush(out);
+		run.lba = lba;
+		run.count = 1;
+		run.value = value;
+		return length;
+	}
+
+	length = run_flush(out);
+
+	uint8_t *record = out + length;
+	uint32_t compressed = lz_compress(page, size, record + sizeof(struct stream_record), size - 1);
+	if (compressed)
+		return length + record_write(record, lba, 1, STREAM_RECORD_LZ, 0, NULL, compressed);
+
+	return length + record_write(record, lba, 1, STREAM_RECORD_RAW, 0, page, size);
+}
+
+// Packs a finished eMMC batch in place, slots absorbed into a run are sent
+// empty.
+static void emmc_pack(uint32_t count)
+{
+	static uint8_t scratch[REPLY_DATA_SIZE] __attribute__((aligned(4)));
+
+	uint64_t lba = stream_next - count;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		struct reply *reply = queue_slot(&engine_replies, engine_replies.head + i);
+		uint32_t length = page_pack(scratch, lba + i, &reply->data[4], 0x200);
+		memcpy(reply->data, scratch, length);
+		reply->length = length;
+	}
+}
+
+static void emmc_commit()
+{
+	trace(TRACE_DMA_END, stream_next - pending, pending);
+
+	if (flags & STREAM_FLAG_COMPRESS)
+		emmc_pack(pending);
+
+	for (uint32_t i = 0; i < pending; ++i)
+		stream_bytes += ((struct reply *)queue_slot(&engine_replies, engine_replies.head + i))->length;
+
+	queue_commit_n(&engine_replies, pending);
+	stream_pages += pending;
+	pending = 0;
+	attempts = 0;
+	if (isolate)
+		--isolate;
+}
+
+// Takes back a batch that came back bad, so it is read again
+static uint32_t emmc_rewind()
+{
+	uint32_t count = pending;
+	stream_next -= count;
+	pending = 0;
+	return count;
+}
+
+void stream_wait()
+{
+	if (pending)
+	{
+		int status;
+		while (!sd_scatter_read_complete(&status))
+			tight_loop_contents();
+		if (status)
+			emmc_rewind();
+		else
+			emmc_commit();
+	}
+}
+
+void stream_set_flags(uint32_t new_flags)
+{
+	stream_flags = new_flags & (STREAM_FLAG_COMPRESS | STREAM_FLAG_EDC | STREAM_FLAG_CONTINUE | STREAM_RETRIES_MASK);
+}
+
+uint32_t stream_get_flags()
+{
+	return stream_flags;
+}
+
+void stream_start(enum stream_source new_source, const struct job *job, uint32_t start, uint32_t count)
+{
+	port = job->port;
+	generation = job->generation;
+	framed = job->framed;
+	seq = job->seq;
+	flags = stream_flags;
+	source = new_source;
+	do_stream = count != 0 || framed; // a framed stream always gets its end frame
+	stream_next = start;
+	stream_end = (uint64_t)start + count;
+	run.count = 0;
+	isolate = 0;
+	attempts = 0;
+
+	trace(TRACE_STREAM_START, start, source);
+
+	perf_wait_reset(&usb_wait);
+	stream_pages = 0;
+	stream_bytes = 0;
+	stream_retries = 0;
+	stream_failed = 0;
+}
+
+bool stream_running()
+{
+	return do_stream;
+}
+
+static struct reply *stream_slot(uint32_t index, uint32_t status, uint32_t length)
+{
+	struct reply *reply = queue_slot(&engine_replies, engine_replies.head + index);
+	reply->length = length;
+	reply->flags = REPLY_STREAM | (framed ? REPLY_FRAMED : 0);
+	reply->port = port;
+	reply->generation = generation;
+	reply->seq = seq;
+	reply->status = FRAME_OK;
+	*(uint32_t *)reply->data = status;
+	return reply;
+}
+
+static void stream_commit(struct reply *reply)
+{
+	stream_bytes += reply->length;
+	queue_commit(&engine_replies);
+}
+
+// Ends the stream at the page that failed, or with STREAM_FLAG_CONTINUE
+// only skips it
+static void stream_fail(uint32_t status)
+{
+	bool skip = flags & STREAM_FLAG_CONTINUE;
+
+	struct reply *reply = stream_slot(0, status, 4);
+	if (flags & STREAM_FLAG_COMPRESS)
+	{
+		reply->length = run_flush(reply->data);
+		reply->length += record_write(&reply->data[reply->length], stream_next, 1, STREAM_RECORD_ERROR, 0, &status, 4);
+	}
+	if (!skip)
+		reply->flags |= REPLY_END;
+
+	stream_commit(reply);
+
+	if (skip)
+	{
+		++stream_failed;
+		++stream_next;
+	}
+	else
+		do_stream = false;
+}
+
+static uint32_t stream_retry_limit()
+{
+	return (flags & STREAM_RETRIES_MASK) >> STREAM_RETRIES_SHIFT;
+}
+
+// Sends what is left of the run once all pages are read, along with the end
+// frame
+static void stream_finish()
+{
+	if (run.count || framed)
+	{
+		bool full = !queue_free(&engine_replies);
+		perf_wait_update(&usb_wait, full);
+		if (full)
+			return;
+
+		struct reply *reply = stream_slot(0, 0, 0);
+		reply->length = run_flush(reply->data);
+		reply->flags |= REPLY_END;
+		stream_commit(reply);
+	}
+
+	do_stream = false;
+}
+
+static int emmc_read(uint32_t count)
+{
+	struct reply *first = queue_slot(&engine_replies, engine_replies.head);
+	return sd_readblocks_strided_async(&first->data[4], sizeof(struct reply), stream_next, count);
+}
+
+static void stream_fill_emmc()
+{
+	int ret = SD_OK;
+	uint32_t count = 0;
+
+	// A CRC error only shows once the batch has landed
+	if (pending)
+	{
+		if (!sd_scatter_read_complete(&ret))
+			return;
+		if (ret)
+			count = emmc_rewind();
+		else
+			emmc_commit();
+	}
+
+	if (!ret)
+	{
+		if (stream_next >= stream_end)
+		{
+			stream_finish();
+			return;
+		}
+
+		// Only issue whole batches, a single freed slot is not worth a CMD23
+		count = engine_replies.count - engine_replies.head % engine_replies.count;
+		if (count > SDIO_MAX_BLOCK_COUNT)
+			count = SDIO_MAX_BLOCK_COUNT;
+		if (isolate)
+			count = 1;
+		if (count > stream_end - stream_next)
+			count = stream_end - stream_next;
+
+		bool full = count > queue_free_contiguous(&engine_replies);
+		perf_wait_update(&usb_wait, full);
+		if (full)
+			return;
+
+		for (uint32_t i = 0; i < count; ++i)
+			stream_slot(i, 0, 4 + 0x200);
+
+		ret = emmc_read(count);
+	}
+
+	while (ret && attempts < stream_retry_limit())
+	{
+		++attempts;
+		++stream_retries;
+		ret = emmc_read(count);
+	}
+
+	if (ret)
+	{
+		attempts = 0;
+
+		// Read the batch again sector by sector, so the good sectors are sent
+		// and the failure names the bad one, which is skipped or ends the
+		// stream
+		if (count > 1)
+		{
+			isolate = count;
+			return;
+		}
+
+		if (isolate)
+			--isolate;
+		stream_fail(ret);
+		return;
+	}
+
+	pending = count;
+	stream_next += count;
+}
+
+static void stream_fill_nand()
+{
+	static uint8_t page[0x210] __attribute__((aligned(4)));
+
+	if (stream_next >= stream_end)
+	{
+		stream_finish();
+		return;
+	}
+
+	bool full = !queue_free(&engine_replies);
+	perf_wait_update(&usb_wait, full);
+	if (full)
+		return;
+
+	struct reply *reply = stream_slot(0, 0, 4 + 0x210);
+	uint8_t *buffer = (flags & STREAM_FLAG_COMPRESS) ? page : &reply->data[4];
+	uint32_t ret = xbox_nand_read_block(stream_next, buffer, &buffer[0x200]);
+	for (uint32_t retry = 0; ret && retry < stream_retry_limit(); ++retry)
+	{
+		++stream_retries;
+		ret = xbox_nand_read_block(stream_next, buffer, &buffer[0x200]);
+	}
+
+	if (ret)
+	{
+		stream_fail(ret);
+		return;
+	}
+
+	// A bad page is sent whole and never joins a run
+	bool edc_ok = !(flags & STREAM_FLAG_EDC) || xbox_nand_check_edc(buffer, &buffer[0x200]);
+	if ((flags & STREAM_FLAG_COMPRESS) && !edc_ok)
+	{
+		reply->length = run_flush(reply->data);
+		reply->length += record_write(&reply->data[reply->length], stream_next, 1, STREAM_RECORD_EDC, 0, page, 0x210);
+	}
+	else if (flags & STREAM_FLAG_COMPRESS)
+		reply->length = page_pack(reply->data, stream_next, page, 0x210);
+	else if (!edc_ok)
+		*(uint32_t *)reply->data = STREAM_EDC_MISMATCH;
+
+	// A page that only extended the run leaves its slot for the next one
+	if (reply->length)
+		stream_commit(reply);
+
+	++stream_pages;
+	++stream_next;
+}
+
+// Spare areas only, SPARE_MAP_PAGES of them per reply
+static void stream_fill_spare()
+{
+	if (stream_next >= stream_end)
+	{
+		stream_finish();
+		return;
+	}
+
+	bool full = !queue_free(&engine_replies);
+	perf_wait_update(&usb_wait, full);
+	if (full)
+		return;
+
+	uint32_t count = SPARE_MAP_PAGES;
+	if (count > stream_end - stream_next)
+		count = stream_end - stream_next;
+
+	struct reply *reply = stream_slot(0, 0, 4);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t ret = xbox_nand_read_spare(stream_next, &reply->data[reply->length]);
+		for (uint32_t retry = 0; ret && retry < stream_retry_limit(); ++retry)
+		{
+			++stream_retries;
+			ret = xbox_nand_read_spare(stream_next, &reply->data[reply->length]);
+		}
+
+		// The map stops before the page that failed, with STREAM_FLAG_CONTINUE
+		// the next one starts after it
+		if (ret)
+		{
+			*(uint32_t *)reply->data = ret;
+			if (flags & STREAM_FLAG_CONTINUE)
+			{
+				++stream_failed;
+				++stream_next;
+			}
+			else
+			{
+				reply->flags |= REPLY_END;
+				do_stream = false;
+			}
+			stream_commit(reply);
+			return;
+		}
+
+		reply->length += 0x10;
+		++stream_pages;
+		++stream_next;
+	}
+
+	stream_commit(reply);
+}
+
+void stream_task()
+{
+	if (!do_stream)
+		return;
+
+	// A newer stream command is queued behind us
+	if (generation != stream_generation)
+	{
+		stream_wait();
+		do_stream = false;
+		return;
+	}
+
+	if (source == STREAM_EMMC)
+		stream_fill_emmc();
+	else if (source == STREAM_NAND_SPARE)
+		stream_fill_spare();
+	else
+		stream_fill_nand();
+}
+
+void stream_get_stats(struct stream_stats *stats)
+{
+	stats->flash_wait_cycles = flash_wait.cycles;
+	stats->usb_wait_cycles = usb_wait.cycles;
+	stats->pages = stream_pages;
+	stats->bytes = stream_bytes;
+	stats->retries = stream_retries;
+	stats->failed = stream_failed;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "engine.h"
+
+#pragma pack(push, 1)
+struct stream_stats
+{
+	uint64_t flash_wait_cycles; // USB had room, but no page was ready
+	uint64_t usb_wait_cycles;	// pages were ready, but the ring was full
+	uint64_t pages;
+	uint64_t bytes; // sent for those pages, less than their size when compressed
+	uint64_t retries;
+	uint64_t failed; // pages skipped with STREAM_FLAG_CONTINUE
+};
+#pragma pack(pop)
+
+enum stream_source
+{
+	STREAM_NAND,
+	STREAM_EMMC,
+	STREAM_NAND_SPARE // spare areas only, see READ_FLASH_SPARE_STREAM
+};
+
+extern volatile uint32_t stream_generation;
+
+// core0
+void stream_cancel();
+void stream_update_flash_wait(bool starved);
+
+// core1
+void stream_set_flags(uint32_t flags);
+uint32_t stream_get_flags();
+void stream_start(enum stream_source source, const struct job *job, uint32_t start, uint32_t count);
+void stream_wait();
+void stream_task();
+bool stream_running();
+void stream_get_stats(struct stream_stats *stats);
+
+#endif
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms and conditions of the GNU General Public License,
+# version 2, as published by the Free Software Foundation.
+#
+# This program is distributed in the hope it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Decodes a TRACE_DUMP reply into a timeline and per-page latencies.
+#
+#   trace_decode.py /dev/ttyACM0 [--clear]
+#   trace_decode.py dump.bin
+
+import struct
+import sys
+
+TRACE_DUMP = 0x0E
+TRACE_DUMP_CLEAR = 0x01
+
+EVENTS = [
+	None,
+	"CMD_START",
+	"CMD_END",
+	"NAND_READ",
+	"NAND_READ_END",
+	"NAND_ERASE",
+	"NAND_PROGRAM",
+	"NAND_DONE",
+	"DMA_START",
+	"DMA_END",
+	"PIO_WAIT",
+	"PIO_STUCK",
+	"USB_FLUSH",
+	"SMC",
+	"STREAM_START",
+]
+
+HEADER = struct.Struct("<III")
+EVENT = struct.Struct("<IHHI")
+
+
+def read_dump(read):
+	events = []
+	for _ in range(2):
+		core, count, dropped = HEADER.unpack(read(HEADER.size))
+		if dropped:
+			print("core%d: %d events dropped" % (core, dropped))
+		for _ in range(count):
+			time, id, aux, arg = EVENT.unpack(read(EVENT.size))
+			events.append((time, core, id, aux, arg))
+	return events
+
+
+def event_name(id):
+	return EVENTS[id] if 0 < id < len(EVENTS) else "0x%04x" % id
+
+
+def timeline(events):
+	start = events[0][0]
+	for time, core, id, aux, arg in events:
+		print("%10u  core%d  %-13s arg 0x%08x aux %u" % ((time - start) & 0xFFFFFFFF, core, event_name(id), arg, aux))
+
+
+# Pairs a start event with the next end event on the same core
+def latencies(events, begin, end, label):
+	open_ = {}
+	samples = []
+	for time, core, id, aux, arg in events:
+		if id == begin:
+			open_[core] = (time, arg)
+		elif id == end and core in open_:
+			started, lba = open_.pop(core)
+			samples.append((lba, (time - started) & 0xFFFFFFFF))
+
+	if not samples:
+		return
+
+	print()
+	print("%s latency (us):" % label)
+	for lba, us in samples:
+		print("  0x%08x %8u" % (lba, us))
+	values = sorted(us for _, us in samples)
+	print("  n %d min %u median %u max %u" % (len(values), values[0], values[len(values) // 2], values[-1]))
+
+
+def main():
+	if len(sys.argv) < 2:
+		print("usage: %s <port|dump.bin> [--clear]" % sys.argv[0])
+		return 1
+
+	path = sys.argv[1]
+	if path.startswith("/dev/") or path.startswith("COM"):
+		import serial
+		port = serial.Serial(path, timeout=2)
+		lba = TRACE_DUMP_CLEAR if "--clear" in sys.argv else 0
+		port.write(struct.pack("<BI", TRACE_DUMP, lba))
+		read = port.read
+	else:
+		read = open(path, "rb").read
+
+	events = read_dump(read)
+	if not events:
+		print("no events")
+		return 0
+
+	events.sort(key=lambda event: event[0])
+	timeline(events)
+	latencies(events, EVENTS.index("NAND_READ"), EVENTS.index("NAND_READ_END"), "NAND page read")
+	latencies(events, EVENTS.index("NAND_PROGRAM"), EVENTS.index("NAND_DONE"), "NAND page program")
+	latencies(events, EVENTS.index("DMA_START"), EVENTS.index("DMA_END"), "eMMC DMA batch")
+	latencies(events, EVENTS.index("CMD_START"), EVENTS.index("CMD_END"), "Command")
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+
+#include "pico/stdlib.h"
+#include "protocol.h"
+#include "engine.h"
+#include "trace.h"
+
+struct trace_ring trace_rings[2];
+
+// Core0 keeps recording while its ring is read, at worst its newest events
+// come out torn.
+void trace_dump(bool clear)
+{
+	for (uint32_t core = 0; core < 2; ++core)
+	{
+		struct trace_ring *ring = &trace_rings[core];
+
+		uint32_t head = ring->head;
+		uint32_t count = head < TRACE_EVENTS ? head : TRACE_EVENTS;
+
+		struct trace_header header;
+		header.core = core;
+		header.count = count;
+		header.dropped = head - count;
+		reply_write(&header, sizeof(header));
+
+		for (uint32_t i = head - count; i != head; ++i)
+			reply_write(&ring->events[i % TRACE_EVENTS], sizeof(struct trace_event));
+
+		if (clear)
+			ring->head = 0;
+	}
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hardware/structs/timer.h"
+#include "hardware/structs/sio.h"
+
+// Timeline of binary events in a ring per core, drained with TRACE_DUMP.
+// Recording is a handful of stores; the oldest events are overwritten.
+
+#ifndef PICOFLASHER_TRACE
+#define PICOFLASHER_TRACE 1
+#endif
+
+#define TRACE_EVENTS 512 // per core, power of two
+
+enum trace_id
+{
+	TRACE_CMD_START = 1, // arg: lba, aux: cmd
+	TRACE_CMD_END,		 // aux: cmd
+	TRACE_NAND_READ,	 // arg: lba, aux: 1 for the spare area only
+	TRACE_NAND_READ_END, // arg: lba, aux: status
+	TRACE_NAND_ERASE,	 // arg: lba
+	TRACE_NAND_PROGRAM,	 // arg: lba
+	TRACE_NAND_DONE,	 // arg: lba, aux: status, ends an erase or program
+	TRACE_DMA_START,	 // arg: sector, aux: count
+	TRACE_DMA_END,		 // arg: sector, aux: count
+	TRACE_PIO_WAIT,		 // arg: state machine pc, aux: spins until idle
+	TRACE_PIO_STUCK,	 // arg: state machine pc, aux: sm
+	TRACE_USB_FLUSH,	 // arg: bytes, aux: port
+	TRACE_SMC,			 // aux: 1 stopped, 0 running
+	TRACE_STREAM_START,	 // arg: first page, aux: enum stream_source
+};
+
+struct trace_event
+{
+	uint32_t time; // us
+	uint16_t id;
+	uint16_t aux;
+	uint32_t arg;
+};
+
+struct trace_ring
+{
+	struct trace_event events[TRACE_EVENTS];
+	uint32_t head;
+};
+
+extern struct trace_ring trace_rings[2];
+
+static inline void trace(enum trace_id id, uint32_t arg, uint16_t aux)
+{
+#if PICOFLASHER_TRACE
+	struct trace_ring *ring = &trace_rings[sio_hw->cpuid];
+	struct trace_event *event = &ring->events[ring->head++ % TRACE_EVENTS];
+	event->time = timer_hw->timerawl;
+	event->id = id;
+	event->aux = aux;
+	event->arg = arg;
+#endif
+}
+
+// core1, replies with both rings
+void trace_dump(bool clear);
+
+#endif
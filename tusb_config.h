@@ -84,10 +84,10 @@ extern "C"
 
 //------------- CLASS -------------//
 #define CFG_TUD_CDC 1
-#define CFG_TUD_MSC 0
+#define CFG_TUD_MSC 1
 #define CFG_TUD_HID 0
 #define CFG_TUD_MIDI 0
-#define CFG_TUD_VENDOR 0
+#define CFG_TUD_VENDOR 1
 
 // CDC FIFO size of TX and RX
 #define CFG_TUD_CDC_RX_BUFSIZE 1024 * 8
@@ -96,6 +96,14 @@ extern "C"
 // CDC Endpoint transfer buffer size, more is faster
 #define CFG_TUD_CDC_EP_BUFSIZE 1024 * 8
 
+// MSC transfer buffer, one request to core1 per buffer
+#define CFG_TUD_MSC_EP_BUFSIZE 1024 * 8
+
+// Vendor bulk interface, 64 bytes is the largest bulk packet at full speed
+#define CFG_TUD_VENDOR_EPSIZE 64
+#define CFG_TUD_VENDOR_RX_BUFSIZE 1024 * 8
+#define CFG_TUD_VENDOR_TX_BUFSIZE 1024 * 16
+
 #ifdef __cplusplus
 }
 #endif
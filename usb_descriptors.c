@@ -23,13 +23,14 @@ tusb_desc_device_t const desc_device =
 	{
 		.bLength = sizeof(tusb_desc_device_t),
 		.bDescriptorType = TUSB_DESC_DEVICE,
-		.bcdUSB = 0x0200,
+		// 2.1 for the BOS descriptor carrying the MS OS 2.0 descriptor
+		.bcdUSB = 0x0210,
 
 		// Use Interface Association Descriptor (IAD) for CDC
 		// As required by USB Specs IAD's subclass must be common class (2) and protocol must be IAD (1)
-		.bDeviceClass = TUSB_CLASS_CDC,
-		.bDeviceSubClass = 0,
-		.bDeviceProtocol = 0,
+		.bDeviceClass = TUSB_CLASS_MISC,
+		.bDeviceSubClass = MISC_SUBCLASS_COMMON,
+		.bDeviceProtocol = MISC_PROTOCOL_IAD,
 
 		.bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
 
@@ -58,20 +59,28 @@ enum
 {
 	ITF_NUM_CDC = 0,
 	ITF_NUM_CDC_DATA,
+	ITF_NUM_VENDOR,
+	ITF_NUM_MSC,
 	ITF_NUM_TOTAL
 };
 
-#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + (9 + 5 + 5 + 4 + 5 + 7 + 9 + 7 + 7))
+#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + (8 + 9 + 5 + 5 + 4 + 5 + 7 + 9 + 7 + 7) + (9 + 7 + 7) + (9 + 7 + 7))
 
 #define EPNUM_CDC_NOTIF 0x81
 #define EPNUM_CDC_OUT 0x02
 #define EPNUM_CDC_IN 0x82
+#define EPNUM_VENDOR_OUT 0x03
+#define EPNUM_VENDOR_IN 0x83
+#define EPNUM_MSC_OUT 0x04
+#define EPNUM_MSC_IN 0x84
 
 uint8_t const desc_fs_configuration[] =
 {
 	// Config number, interface count, string index, total length, attribute, power in mA
 	TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
 
+	/* CDC Interface Association */
+	8, TUSB_DESC_INTERFACE_ASSOCIATION, ITF_NUM_CDC, 2, TUSB_CLASS_CDC, CDC_COMM_SUBCLASS_ABSTRACT_CONTROL_MODEL, CDC_COMM_PROTOCOL_ATCOMMAND, 0,
 	/* CDC Control Interface */
 	9, TUSB_DESC_INTERFACE, ITF_NUM_CDC, 0, 1, TUSB_CLASS_CDC, CDC_COMM_SUBCLASS_ABSTRACT_CONTROL_MODEL, CDC_COMM_PROTOCOL_ATCOMMAND, 0,
 	/* CDC Header */
@@ -90,6 +99,20 @@ uint8_t const desc_fs_configuration[] =
 	7, TUSB_DESC_ENDPOINT, EPNUM_CDC_OUT, TUSB_XFER_BULK, U16_TO_U8S_LE(64), 0,
 	/* Endpoint In */
 	7, TUSB_DESC_ENDPOINT, EPNUM_CDC_IN, TUSB_XFER_BULK, U16_TO_U8S_LE(64), 0,
+
+	/* Vendor Interface, same protocol as CDC but without the tty layer on the host */
+	9, TUSB_DESC_INTERFACE, ITF_NUM_VENDOR, 0, 2, TUSB_CLASS_VENDOR_SPECIFIC, 0, 0, 0,
+	/* Endpoint Out */
+	7, TUSB_DESC_ENDPOINT, EPNUM_VENDOR_OUT, TUSB_XFER_BULK, U16_TO_U8S_LE(CFG_TUD_VENDOR_EPSIZE), 0,
+	/* Endpoint In */
+	7, TUSB_DESC_ENDPOINT, EPNUM_VENDOR_IN, TUSB_XFER_BULK, U16_TO_U8S_LE(CFG_TUD_VENDOR_EPSIZE), 0,
+
+	/* MSC Interface, bulk only transport */
+	9, TUSB_DESC_INTERFACE, ITF_NUM_MSC, 0, 2, TUSB_CLASS_MSC, MSC_SUBCLASS_SCSI, MSC_PROTOCOL_BOT, 0,
+	/* Endpoint Out */
+	7, TUSB_DESC_ENDPOINT, EPNUM_MSC_OUT, TUSB_XFER_BULK, U16_TO_U8S_LE(64), 0,
+	/* Endpoint In */
+	7, TUSB_DESC_ENDPOINT, EPNUM_MSC_IN, TUSB_XFER_BULK, U16_TO_U8S_LE(64), 0,
 };
 
 // Invoked when received GET CONFIGURATION DESCRIPTOR
@@ -102,6 +125,76 @@ uint8_t const *tud_descriptor_configuration_cb(uint8_t index)
 	return desc_fs_configuration;
 }
 
+//--------------------------------------------------------------------+
+// BOS Descriptor
+//--------------------------------------------------------------------+
+
+// Lets Windows bind WinUSB to the vendor interface without an INF, so libusb
+// can claim it on every platform.
+
+#define VENDOR_REQUEST_MICROSOFT 1
+
+#define BOS_TOTAL_LEN (TUD_BOS_DESC_LEN + TUD_BOS_MICROSOFT_OS_DESC_LEN)
+
+#define MS_OS_20_DESC_LEN 0xB2
+
+uint8_t const desc_bos[] =
+{
+	// total length, number of device caps
+	TUD_BOS_DESCRIPTOR(BOS_TOTAL_LEN, 1),
+
+	// Microsoft OS 2.0 descriptor
+	TUD_BOS_MS_OS_20_DESCRIPTOR(MS_OS_20_DESC_LEN, VENDOR_REQUEST_MICROSOFT)
+};
+
+uint8_t const *tud_descriptor_bos_cb(void)
+{
+	return desc_bos;
+}
+
+uint8_t const desc_ms_os_20[] =
+{
+	// Set header: length, type, windows version, total length
+	U16_TO_U8S_LE(0x000A), U16_TO_U8S_LE(MS_OS_20_SET_HEADER_DESCRIPTOR), U32_TO_U8S_LE(0x06030000), U16_TO_U8S_LE(MS_OS_20_DESC_LEN),
+
+	// Configuration subset header: length, type, configuration index, reserved, configuration total length
+	U16_TO_U8S_LE(0x0008), U16_TO_U8S_LE(MS_OS_20_SUBSET_HEADER_CONFIGURATION), 0, 0, U16_TO_U8S_LE(MS_OS_20_DESC_LEN - 0x0A),
+
+	// Function Subset header: length, type, first interface, reserved, subset length
+	U16_TO_U8S_LE(0x0008), U16_TO_U8S_LE(MS_OS_20_SUBSET_HEADER_FUNCTION), ITF_NUM_VENDOR, 0, U16_TO_U8S_LE(MS_OS_20_DESC_LEN - 0x0A - 0x08),
+
+	// MS OS 2.0 Compatible ID descriptor: length, type, compatible ID, sub compatible ID
+	U16_TO_U8S_LE(0x0014), U16_TO_U8S_LE(MS_OS_20_FEATURE_COMPATBLE_ID), 'W', 'I', 'N', 'U', 'S', 'B', 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // sub-compatible
+
+	// MS OS 2.0 Registry property descriptor: length, type
+	U16_TO_U8S_LE(MS_OS_20_DESC_LEN - 0x0A - 0x08 - 0x08 - 0x14), U16_TO_U8S_LE(MS_OS_20_FEATURE_REG_PROPERTY),
+	U16_TO_U8S_LE(0x0007), U16_TO_U8S_LE(0x002A), // wPropertyDataType, wPropertyNameLength and PropertyName "DeviceInterfaceGUIDs\0" in UTF-16
+	'D', 0x00, 'e', 0x00, 'v', 0x00, 'i', 0x00, 'c', 0x00, 'e', 0x00, 'I', 0x00, 'n', 0x00, 't', 0x00, 'e', 0x00,
+	'r', 0x00, 'f', 0x00, 'a', 0x00, 'c', 0x00, 'e', 0x00, 'G', 0x00, 'U', 0x00, 'I', 0x00, 'D', 0x00, 's', 0x00, 0x00, 0x00,
+	U16_TO_U8S_LE(0x0050), // wPropertyDataLength
+	// bPropertyData: "{8C1E6F1A-2E58-4C51-9A0B-50494346534C}"
+	'{', 0x00, '8', 0x00, 'C', 0x00, '1', 0x00, 'E', 0x00, '6', 0x00, 'F', 0x00, '1', 0x00, 'A', 0x00, '-', 0x00,
+	'2', 0x00, 'E', 0x00, '5', 0x00, '8', 0x00, '-', 0x00, '4', 0x00, 'C', 0x00, '5', 0x00, '1', 0x00, '-', 0x00,
+	'9', 0x00, 'A', 0x00, '0', 0x00, 'B', 0x00, '-', 0x00, '5', 0x00, '0', 0x00, '4', 0x00, '9', 0x00, '4', 0x00,
+	'3', 0x00, '4', 0x00, '6', 0x00, '5', 0x00, '3', 0x00, '4', 0x00, 'C', 0x00, '}', 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+TU_VERIFY_STATIC(sizeof(desc_ms_os_20) == MS_OS_20_DESC_LEN, "Incorrect size");
+
+// Invoked when a vendor control request is received on EP0
+bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request)
+{
+	if (stage != CONTROL_STAGE_SETUP)
+		return true;
+
+	if (request->bmRequestType_bit.type == TUSB_REQ_TYPE_VENDOR &&
+		request->bRequest == VENDOR_REQUEST_MICROSOFT && request->wIndex == 7)
+		return tud_control_xfer(rhport, request, (void *)(uintptr_t)desc_ms_os_20, sizeof(desc_ms_os_20));
+
+	return false;
+}
+
 //--------------------------------------------------------------------+
 // String Descriptors
 //--------------------------------------------------------------------+
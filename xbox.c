@@ -14,10 +14,16 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+
 #include "pico/stdlib.h"
+#include "protocol.h"
 #include "pins.h"
 #include "spiex.h"
 #include "pio_spi.h"
+#include "perf.h"
+#include "trace.h"
+#include "edc.h"
 
 void xbox_init()
 {
@@ -90,16 +96,24 @@ void xbox_nand_clear_status()
 
 int xbox_nand_wait_ready(uint16_t timeout)
 {
+	uint32_t polls = 0;
+
 	do
 	{
+		++polls;
 		if (!(xbox_nand_get_status() & 0x01))
+		{
+			perf_count(PERF_NAND_WAIT, polls);
 			return 0;
+		}
 	} while (timeout--);
 
+	perf_count(PERF_NAND_WAIT, polls);
 	return 1;
 }
 
-int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+// Loads a page into the SMC's page buffer
+static int nand_load_page(uint32_t lba)
 {
 	xbox_nand_clear_status();
 
@@ -110,30 +124,94 @@ int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
 	if (xbox_nand_wait_ready(0x1000))
 		return 0x8000 | xbox_nand_get_status();
 
+	return 0;
+}
+
+static int nand_read_page(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+{
+	int ret = nand_load_page(lba);
+	if (ret)
+		return ret;
+
 	spiex_write_reg(0x0C, 0);
 
-	uint8_t *end = buffer + 0x200;
-	while (buffer < end)
-	{
-		spiex_write_reg(0x08, 0x00);
+	uint32_t words[0x210 / 4];
+	spiex_read_burst(words, 0x210 / 4);
 
-		*(uint32_t *) buffer = spiex_read_reg(0x10);
-		buffer += 4;
-	}
+	memcpy(buffer, words, 0x200);
+	memcpy(spare, &words[0x200 / 4], 0x10);
 
-	end = spare + 0x10;
-	while (spare < end)
-	{
-		spiex_write_reg(0x08, 0x00);
+	return 0;
+}
 
-		*(uint32_t *)spare = spiex_read_reg(0x10);
-		spare += 4;
-	}
+int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+{
+	trace(TRACE_NAND_READ, lba, 0);
+	int ret = nand_read_page(lba, buffer, spare);
+	trace(TRACE_NAND_READ_END, lba, ret);
+	return ret;
+}
+
+// Only the spare area, the buffer is addressed from its start at 0x200
+static int nand_read_spare(uint32_t lba, uint8_t *spare)
+{
+	int ret = nand_load_page(lba);
+	if (ret)
+		return ret;
+
+	spiex_write_reg(0x0C, 0x200);
+
+	uint32_t words[0x10 / 4];
+	spiex_read_burst(words, 0x10 / 4);
+
+	memcpy(spare, words, 0x10);
 
 	return 0;
 }
 
-int xbox_nand_erase_block(uint32_t lba)
+int xbox_nand_read_spare(uint32_t lba, uint8_t *spare)
+{
+	trace(TRACE_NAND_READ, lba, 1);
+	int ret = nand_read_spare(lba, spare);
+	trace(TRACE_NAND_READ_END, lba, ret);
+	return ret;
+}
+
+// The 26 bit EDC kept in the top bits of spare bytes 12..15, an LFSR over the
+// inverted data and the spare bits in front of it (libxenon's
+// sfcx_calcecc), here a byte at a time.
+uint32_t xbox_nand_calc_edc(const uint8_t *buffer, const uint8_t *spare)
+{
+	uint32_t edc = 0;
+
+	for (uint32_t i = 0; i < 0x200; ++i)
+		edc = edc_table[(edc ^ ~buffer[i]) & 0xFF] ^ (edc >> 8);
+	for (uint32_t i = 0; i < 12; ++i)
+		edc = edc_table[(edc ^ ~spare[i]) & 0xFF] ^ (edc >> 8);
+
+	// The low 6 bits of spare byte 12
+	uint32_t bits = ~spare[12];
+	for (uint32_t i = 0; i < 6; ++i, bits >>= 1)
+	{
+		edc ^= bits & 1;
+		edc = (edc & 1) ? (edc >> 1) ^ 0x34AA2AC : edc >> 1;
+	}
+
+	return ~edc & 0x3FFFFFF;
+}
+
+bool xbox_nand_check_edc(const uint8_t *buffer, const uint8_t *spare)
+{
+	uint32_t start = perf_cycles();
+
+	uint32_t stored = (spare[12] >> 6) | (spare[13] << 2) | (spare[14] << 10) | (spare[15] << 18);
+	bool ok = xbox_nand_calc_edc(buffer, spare) == stored;
+
+	perf_count(PERF_NAND_EDC, perf_elapsed(start));
+	return ok;
+}
+
+static int nand_erase_block(uint32_t lba)
 {
 	xbox_nand_clear_status();
 
@@ -151,7 +229,15 @@ int xbox_nand_erase_block(uint32_t lba)
 	return 0;
 }
 
-int xbox_nand_write_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+int xbox_nand_erase_block(uint32_t lba)
+{
+	trace(TRACE_NAND_ERASE, lba, 0);
+	int ret = nand_erase_block(lba);
+	trace(TRACE_NAND_DONE, lba, ret);
+	return ret;
+}
+
+uint32_t xbox_nand_pages_per_block()
 {
 	int flash_config = xbox_get_flash_config();
 
@@ -167,16 +253,99 @@ int xbox_nand_write_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
 			blocksize = 0x40000;
 	}
 
-	int sectors_in_block = blocksize  / 0x200;
+	return blocksize / 0x200;
+}
+
+// Total pages, following the flash config decode of libxenon's sfcx_init.
+// 0 for the configs it does not support.
+uint32_t xbox_nand_pages()
+{
+	int flash_config = xbox_get_flash_config();
+
+	int major = (flash_config >> 17) & 3;
+	int minor = (flash_config >> 4) & 3;
 
-	// erase ereases `blocksize` bytes
-	if (lba % sectors_in_block == 0)
+	// Majors 0 to 2 only, anything left undecoded stays 0
+	uint32_t size = 0;
+	uint32_t shift = ((flash_config >> 19) & 3) + ((flash_config >> 21) & 0xF) + 23;
+	if (major == 0)
+		size = minor ? 0x800000 << minor : 0;
+	else if (major > 2)
+		size = 0;
+	else if (minor >= 2)
+		size = shift < 32 ? 1u << shift : 0;
+	else if (minor == 1)
+		size = major == 1 ? 0x1000000 : 0x4000000;
+	else if (major == 2)
+		size = 0x1000000;
+
+	return size / 0x200;
+}
+
+// libxenon's meta types: 0 small block on the original controller, 1 small
+// block on the Jasper one, 2 big block
+static int nand_meta_type()
+{
+	if (((xbox_get_flash_config() >> 17) & 3) == 0)
+		return 0;
+
+	return xbox_nand_pages_per_block() > 0x4000 / 0x200 ? 2 : 1;
+}
+
+// Spare layouts of libxenon's METADATA_SMALLBLOCK, _BIGONSMALL and _BIGBLOCK
+void xbox_nand_build_spare(const uint8_t *buffer, uint8_t *spare, const struct nand_block_meta *meta)
+{
+	uint8_t id1 = meta->id;
+	uint8_t id0 = (meta->id >> 8) & 0x0F;
+	uint32_t seq = meta->fs_sequence;
+
+	memset(spare, 0, 0x10);
+
+	int type = nand_meta_type();
+	if (type == 0)
 	{
-		int ret = xbox_nand_erase_block(lba);
-		if (ret)
-			return ret;
+		spare[0] = id1;
+		spare[1] = id0;
+		spare[2] = seq;
+		spare[3] = seq >> 8;
+		spare[4] = seq >> 16;
+		spare[5] = 0xFF;
+		spare[6] = seq >> 24;
+	}
+	else if (type == 1)
+	{
+		spare[0] = seq;
+		spare[1] = id1;
+		spare[2] = id0;
+		spare[3] = seq >> 8;
+		spare[4] = seq >> 16;
+		spare[5] = 0xFF;
+		spare[6] = seq >> 24;
 	}
+	else
+	{
+		spare[0] = 0xFF;
+		spare[1] = id1;
+		spare[2] = id0;
+		spare[3] = seq >> 16;
+		spare[4] = seq >> 8;
+		spare[5] = seq;
+	}
+
+	spare[7] = meta->fs_size;
+	spare[8] = meta->fs_size >> 8;
+	spare[9] = meta->fs_page_count;
+	spare[12] = meta->fs_type & 0x3F;
 
+	uint32_t edc = xbox_nand_calc_edc(buffer, spare);
+	spare[12] |= edc << 6;
+	spare[13] = edc >> 2;
+	spare[14] = edc >> 10;
+	spare[15] = edc >> 18;
+}
+
+static int nand_program_page(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+{
 	xbox_nand_clear_status();
 
 	spiex_write_reg(0x0C, 0);
@@ -218,3 +387,24 @@ int xbox_nand_write_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
 
 	return 0;
 }
+
+int xbox_nand_program_page(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+{
+	trace(TRACE_NAND_PROGRAM, lba, 0);
+	int ret = nand_program_page(lba, buffer, spare);
+	trace(TRACE_NAND_DONE, lba, ret);
+	return ret;
+}
+
+int xbox_nand_write_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+{
+	// erase ereases a whole block
+	if (lba % xbox_nand_pages_per_block() == 0)
+	{
+		int ret = xbox_nand_erase_block(lba);
+		if (ret)
+			return ret;
+	}
+
+	return xbox_nand_program_page(lba, buffer, spare);
+}
@@ -17,14 +17,34 @@
 #ifndef __XBOX_H__
 #define __XBOX_H__
 
+// SFCX status register bits, named as in libxenon's sfcx driver
+#define SFCX_STATUS_BUSY 0x001
+#define SFCX_STATUS_BB_ER 0x002 // bad block
+#define SFCX_STATUS_RNP_ER 0x004
+#define SFCX_STATUS_ILL_LOG 0x008
+#define SFCX_STATUS_PIN_WP_N 0x010
+#define SFCX_STATUS_ADDR_ER 0x020
+#define SFCX_STATUS_ECC_ER 0x1C0 // corrected
+
+struct nand_block_meta;
+
 void xbox_init();
 
 void xbox_start_smc();
 void xbox_stop_smc();
 
 uint32_t xbox_get_flash_config();
+uint16_t xbox_nand_get_status();
+void xbox_nand_clear_status();
 int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare);
+int xbox_nand_read_spare(uint32_t lba, uint8_t *spare);
+uint32_t xbox_nand_calc_edc(const uint8_t *buffer, const uint8_t *spare);
+bool xbox_nand_check_edc(const uint8_t *buffer, const uint8_t *spare);
+void xbox_nand_build_spare(const uint8_t *buffer, uint8_t *spare, const struct nand_block_meta *meta);
 int xbox_nand_erase_block(uint32_t lba);
+uint32_t xbox_nand_pages_per_block();
+uint32_t xbox_nand_pages();
+int xbox_nand_program_page(uint32_t lba, uint8_t *buffer, uint8_t *spare);
 int xbox_nand_write_block(uint32_t lba, uint8_t *buffer, uint8_t *spare);
 
 #endif